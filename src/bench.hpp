@@ -0,0 +1,100 @@
+#ifndef BENCH_HPP__
+#define BENCH_HPP__
+
+#include <cstdint>
+#include <cinttypes>
+#include <ctime>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#  define BENCH_HAVE_TSC
+#endif
+
+/**
+ * Wall clock and cycle counter for micro benchmarks.
+ *
+ * Cycles come from the TSC on x86. Other architectures have no cycle
+ * counter readable from user space, so cycles are derived from the
+ * elapsed time and the CPU clock given by set_mhz().
+ */
+class bench_timer {
+public:
+	bench_timer() :
+		ns_start(0), ns_stop(0),
+		cyc_start(0), cyc_stop(0),
+		mhz(0)
+	{
+	}
+
+	double get_mhz() const
+	{
+		return mhz;
+	}
+
+	void set_mhz(double m)
+	{
+		mhz = m;
+	}
+
+	void start()
+	{
+		ns_start = now_ns();
+		cyc_start = now_cycles();
+	}
+
+	void stop()
+	{
+		cyc_stop = now_cycles();
+		ns_stop = now_ns();
+	}
+
+	uint64_t get_ns() const
+	{
+		return ns_stop - ns_start;
+	}
+
+	bool has_cycles() const
+	{
+#if defined(BENCH_HAVE_TSC)
+		return true;
+#else
+		return mhz > 0;
+#endif
+	}
+
+	double get_cycles() const
+	{
+#if defined(BENCH_HAVE_TSC)
+		if (mhz <= 0)
+			return (double)(cyc_stop - cyc_start);
+#endif
+		return (double)get_ns() * mhz / 1000;
+	}
+
+	static uint64_t now_ns()
+	{
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+
+	static uint64_t now_cycles()
+	{
+#if defined(BENCH_HAVE_TSC)
+		return __rdtsc();
+#else
+		return 0;
+#endif
+	}
+
+private:
+	uint64_t ns_start;
+	uint64_t ns_stop;
+	uint64_t cyc_start;
+	uint64_t cyc_stop;
+	double mhz;
+};
+
+#endif //BENCH_HPP__
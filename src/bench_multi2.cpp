@@ -0,0 +1,263 @@
+#include <cstdio>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+#include <getopt.h>
+
+#include <random>
+#include <vector>
+
+#include "bench.hpp"
+#include "packet_ts.hpp"
+#include "multi2.hpp"
+#include "multi2_sse2.hpp"
+#include "multi2_neon.hpp"
+#include "descrambler_ts.hpp"
+
+#define SIZE_TS          188
+#define SIZE_WORK        (64 * 1024)
+#define NUM_WORK_TS      1024
+
+struct bench_param {
+	size_t n_key;
+	size_t n_blk;
+	size_t n_pkt;
+	double mhz;
+	uint32_t seed;
+	const char *backend;
+};
+
+//Keep results alive so the compiler cannot drop the work
+static volatile uint64_t bench_sink;
+
+void usage(int argc, char *argv[])
+{
+	fprintf(stderr, "usage: %s [-k keys] [-n blocks] [-p packets] "
+			"[-m MHz] [-s seed] [-b backend]\n\n"
+		"  -k keys   : Number of key schedules (default: 1000000)\n"
+		"  -n blocks : Number of 8 bytes blocks per update test\n"
+		"              (default: 4194304)\n"
+		"  -p packets: Number of TS packets to descramble\n"
+		"              (default: 1000000)\n"
+		"  -m MHz    : CPU clock to derive cycles from time,\n"
+		"              use the TSC on x86 if not specified\n"
+		"  -s seed   : Seed of synthetic keys and payloads\n"
+		"  -b backend: Run only the named backend\n",
+		argv[0]);
+}
+
+void fill_random(std::mt19937& rnd, uint8_t *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = rnd();
+}
+
+void report(const char *backend, const char *test, size_t ops,
+	size_t bytes_per_op, const bench_timer& t)
+{
+	double ns = (double)t.get_ns();
+	double bytes = (double)ops * bytes_per_op;
+
+	printf("%-12s %-12s %10.2f ns/op", backend, test, ns / ops);
+
+	if (bytes_per_op) {
+		printf(" %10.2f MB/s", bytes / ns * 1000000000 / 1024 / 1024);
+		if (t.has_cycles())
+			printf(" %8.2f cycles/byte", t.get_cycles() / bytes);
+	} else {
+		printf(" %15s", "");
+		if (t.has_cycles())
+			printf(" %8.2f cycles/op", t.get_cycles() / ops);
+	}
+	printf("\n");
+}
+
+template <class M>
+void bench_keyschedule(const char *name, const bench_param& p,
+	std::mt19937& rnd)
+{
+	uint8_t key[ALL_KEY_SIZE];
+	bench_timer t;
+	M m;
+
+	t.set_mhz(p.mhz);
+	fill_random(rnd, key, sizeof(key));
+
+	t.start();
+	for (size_t i = 0; i < p.n_key; i++) {
+		key[0] = i;
+		m.init(1, key, ALL_KEY_SIZE);
+	}
+	t.stop();
+
+	bench_sink += m.get_workkey()[0];
+	report(name, "keyschedule", p.n_key, 0, t);
+}
+
+template <class M, int N>
+void bench_update(const char *name, const char *test, const bench_param& p,
+	std::mt19937& rnd, uint8_t *buf_in, uint8_t *buf_out)
+{
+	uint8_t key[ALL_KEY_SIZE];
+	size_t blk_per_op = N, pos = 0;
+	size_t ops = p.n_blk / blk_per_op;
+	bench_timer t;
+	M m;
+
+	t.set_mhz(p.mhz);
+	fill_random(rnd, key, sizeof(key));
+	fill_random(rnd, buf_in, SIZE_WORK);
+	m.init(1, key, ALL_KEY_SIZE);
+
+	t.start();
+	for (size_t i = 0; i < ops; i++) {
+		if (N == 8)
+			m.update8(&buf_in[pos], &buf_out[pos]);
+		else if (N == 4)
+			m.update4(&buf_in[pos], &buf_out[pos]);
+		else
+			m.update(buf_in, pos, buf_out, pos);
+
+		pos += DATA_BLK_SIZE * blk_per_op;
+		if (pos >= SIZE_WORK)
+			pos = 0;
+	}
+	t.stop();
+
+	bench_sink += buf_out[0];
+	report(name, test, ops, DATA_BLK_SIZE * blk_per_op, t);
+}
+
+/**
+ * Build scrambled looking TS packets, half of them have a short
+ * adaptation field to leave a residue for the OFB mode. Odd and even
+ * keys are used alternately.
+ */
+void build_packets(std::mt19937& rnd, uint8_t *buf, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		uint8_t *pkt = &buf[i * SIZE_TS];
+
+		fill_random(rnd, pkt, SIZE_TS);
+
+		pkt[0] = 0x47;
+		pkt[1] = 0x01;
+		pkt[2] = 0x00;
+		if (i & 1) {
+			//odd key, adaptation field + payload
+			pkt[3] = 0xf0 | (i & 0xf);
+			pkt[4] = 3;
+			pkt[5] = 0x00;
+			pkt[6] = 0xff;
+			pkt[7] = 0xff;
+		} else {
+			//even key, payload only
+			pkt[3] = 0x90 | (i & 0xf);
+		}
+	}
+}
+
+template <class M>
+void bench_packet(const char *name, const bench_param& p,
+	std::mt19937& rnd, uint8_t *buf_ts)
+{
+	uint8_t system_key[SYSTEM_KEY_SIZE];
+	basic_descrambler_ts<M> desc;
+	bench_timer t;
+
+	t.set_mhz(p.mhz);
+	fill_random(rnd, system_key, sizeof(system_key));
+	desc.set_system_key(system_key);
+	desc.set_init_vector(((uint64_t)rnd() << 32) | rnd());
+	desc.set_data_key_odd(((uint64_t)rnd() << 32) | rnd());
+	desc.set_data_key_even(((uint64_t)rnd() << 32) | rnd());
+	build_packets(rnd, buf_ts, NUM_WORK_TS);
+
+	t.start();
+	for (size_t i = 0; i < p.n_pkt; i++) {
+		uint8_t *pkt = &buf_ts[(i % NUM_WORK_TS) * SIZE_TS];
+		bitstream<uint8_t *> bs(pkt, 0, SIZE_TS);
+		packet_ts ts;
+		ts.set_light_mode(true);
+
+		ts.peek(bs);
+		desc.descramble(ts);
+	}
+	t.stop();
+
+	bench_sink += buf_ts[SIZE_TS - 1];
+	report(name, "packet", p.n_pkt, SIZE_TS, t);
+}
+
+template <class M>
+void bench_backend(const char *name, const bench_param& p)
+{
+	std::mt19937 rnd(p.seed);
+	std::vector<uint8_t> buf_in(SIZE_WORK), buf_out(SIZE_WORK);
+	std::vector<uint8_t> buf_ts(SIZE_TS * NUM_WORK_TS);
+
+	if (p.backend && strcmp(p.backend, name) != 0)
+		return;
+
+	bench_keyschedule<M>(name, p, rnd);
+	bench_update<M, 1>(name, "update", p, rnd, &buf_in[0], &buf_out[0]);
+	bench_update<M, 4>(name, "update4", p, rnd, &buf_in[0], &buf_out[0]);
+	bench_update<M, 8>(name, "update8", p, rnd, &buf_in[0], &buf_out[0]);
+	bench_packet<M>(name, p, rnd, &buf_ts[0]);
+}
+
+int main(int argc, char *argv[])
+{
+	bench_param p;
+	int opt;
+
+	p.n_key = 1000000;
+	p.n_blk = 4 * 1024 * 1024;
+	p.n_pkt = 1000000;
+	p.mhz = 0;
+	p.seed = 1;
+	p.backend = NULL;
+
+	while ((opt = getopt(argc, argv, "k:n:p:m:s:b:h")) != -1) {
+		switch (opt) {
+		case 'k':
+			p.n_key = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			p.n_blk = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			p.n_pkt = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			p.mhz = strtod(optarg, NULL);
+			break;
+		case 's':
+			p.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			p.backend = optarg;
+			break;
+		default:
+			usage(argc, argv);
+			return -1;
+		}
+	}
+
+	if (p.n_key == 0 || p.n_blk < 8 || p.n_pkt == 0) {
+		usage(argc, argv);
+		return -1;
+	}
+
+	bench_backend<multi2>("multi2", p);
+#if defined(__SSE2__)
+	bench_backend<multi2_sse2>("multi2_sse2", p);
+#endif
+#if defined(__ARM_NEON)
+	bench_backend<multi2_neon>("multi2_neon", p);
+#endif
+
+	return 0;
+}
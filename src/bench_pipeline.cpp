@@ -0,0 +1,262 @@
+#include <cstdio>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "context.hpp"
+#include "descramble_parallel.hpp"
+#include "card_script.hpp"
+
+void usage(int argc, char *argv[])
+{
+	fprintf(stderr, "usage: %s -f fixture [-d usec] [-r repeat] "
+			"[-o output] [-j jobs] input\n\n"
+		"  -f fixture: Synthetic keys of scripted card\n"
+		"  -d usec   : Response delay of scripted card,\n"
+		"              override the delay of fixture\n"
+		"  -r repeat : Number of runs (default: 3)\n"
+		"  -o output : Output file name (default: /dev/null)\n"
+		"  -j jobs   : Descramble by segments in parallel using\n"
+		"              ECM index\n"
+		"  input     : TS file made by gen_ts\n",
+		argv[0]);
+}
+
+int load_file(const char *name, std::vector<char>& buf)
+{
+	char tmp[65536];
+	ssize_t n;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd == -1) {
+		perror("open(in)");
+		fprintf(stderr, "Failed to open '%s'\n", name);
+		return -1;
+	}
+
+	buf.clear();
+	while ((n = read(fd, tmp, sizeof(tmp))) > 0)
+		buf.insert(buf.end(), tmp, tmp + n);
+	close(fd);
+
+	if (n == -1) {
+		perror("read(in)");
+		return -1;
+	}
+
+	//Drop the last partial chunk
+	buf.resize(buf.size() - buf.size() % SIZE_TS_CHUNK);
+
+	return 0;
+}
+
+size_t count_scrambled(const char *buf, size_t len)
+{
+	size_t cnt = 0;
+
+	for (size_t pos = 0; pos < len; pos += SIZE_TS) {
+		if (buf[pos + 3] & 0x80)
+			cnt++;
+	}
+
+	return cnt;
+}
+
+int bench_run(card_reader_base& scrd, std::vector<char>& work, int fd_out)
+{
+	std::unique_ptr<context> c(new context);
+	bench_timer t;
+	size_t scrambled = 0;
+	double sec;
+
+	c->set_card_reader(&scrd);
+	c->reset_ts_filter();
+	c->start();
+
+	t.start();
+	for (size_t pos = 0; pos <= work.size(); pos += SIZE_TS_CHUNK) {
+		size_t len = 0;
+
+		if (pos < work.size())
+			len = proc_ts_chunk(*c, &work[pos], SIZE_TS_CHUNK);
+		else
+			proc_ts_flush(*c);
+
+		//Held packets are written before the chunk
+		std::vector<char>& rel = c->buf_released;
+
+		if (!rel.empty()) {
+			if (write(fd_out, &rel[0], rel.size()) == -1) {
+				perror("write");
+				return -1;
+			}
+			scrambled += count_scrambled(&rel[0], rel.size());
+			rel.clear();
+		}
+
+		if (write(fd_out, work.data() + pos, len) == -1) {
+			perror("write");
+			return -1;
+		}
+		scrambled += count_scrambled(work.data() + pos, len);
+	}
+	t.stop();
+
+	sec = (double)t.get_ns() / 1000000000;
+	printf("pipeline: %.2f MB/s, %.3f sec, %zu packets, "
+		"%zu scrambled left\n",
+		(double)work.size() / 1024 / 1024 / sec, sec,
+		work.size() / SIZE_TS, scrambled);
+	if (c->cnt_ecm_card) {
+		printf("key switch: %" PRIu64 " times, "
+			"avg %.3f ms, max %.3f ms\n",
+			c->cnt_ecm_card,
+			(double)c->ns_ecm_card_sum / c->cnt_ecm_card / 1000000,
+			(double)c->ns_ecm_card_max / 1000000);
+	}
+	printf("hold: %" PRIu64 " packets, %" PRIu64 " by timeout, "
+		"%" PRIu64 " by overflow\n",
+		c->cnt_held, c->cnt_hold_timeout, c->cnt_hold_overflow);
+	printf("ecm cache: %" PRIu64 " hit, %" PRIu64 " in flight, "
+		"%" PRIu64 " miss\n",
+		c->cache_ecm.cnt_hit, c->cache_ecm.cnt_pending,
+		c->cache_ecm.cnt_miss);
+
+	return 0;
+}
+
+int bench_run_parallel(card_reader_base& scrd, std::vector<char>& work,
+	int fd_out, int jobs)
+{
+	std::unique_ptr<ecm_index> idx(new ecm_index);
+	std::vector<std::thread> ths;
+	segment_keys keys;
+	bench_timer t, t_scan, t_card;
+	double sec;
+
+	t.start();
+
+	t_scan.start();
+	idx->scan(&work[0], work.size());
+	t_scan.stop();
+
+	t_card.start();
+	keys.lookup(scrd, *idx);
+	if (!keys.is_valid())
+		return -1;
+	t_card.stop();
+
+	for (int j = 0; j < jobs; j++) {
+		size_t st = work.size() / SIZE_TS * j / jobs * SIZE_TS;
+		size_t end = work.size() / SIZE_TS * (j + 1) / jobs * SIZE_TS;
+
+		ths.push_back(std::thread([&, st, end] {
+			segment_descrambler seg(*idx, keys);
+
+			seg.seek(st);
+			seg.proc(&work[st], end - st, st);
+		}));
+	}
+	for (auto& th : ths)
+		th.join();
+	t.stop();
+
+	if (write(fd_out, &work[0], work.size()) == -1) {
+		perror("write");
+		return -1;
+	}
+
+	sec = (double)t.get_ns() / 1000000000;
+	idx->dump(stdout);
+	printf("parallel: %.2f MB/s, %.3f sec (scan %.3f sec, card %.3f sec), "
+		"%d segments, %zu scrambled left\n",
+		(double)work.size() / 1024 / 1024 / sec, sec,
+		(double)t_scan.get_ns() / 1000000000,
+		(double)t_card.get_ns() / 1000000000, jobs,
+		count_scrambled(&work[0], work.size()));
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name_fixture = NULL, *name_in = NULL;
+	const char *name_out = "/dev/null";
+	std::vector<char> input, work;
+	int repeat = 3, delay = -1, jobs = 0;
+	int fd_out, opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "f:d:r:o:j:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			name_fixture = optarg;
+			break;
+		case 'd':
+			delay = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			repeat = strtol(optarg, NULL, 0);
+			break;
+		case 'o':
+			name_out = optarg;
+			break;
+		case 'j':
+			jobs = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argc, argv);
+			return -1;
+		}
+	}
+
+	if (!name_fixture || optind >= argc || repeat <= 0) {
+		usage(argc, argv);
+		return -1;
+	}
+	name_in = argv[optind];
+
+	card_reader_script scrd(name_fixture);
+	if (!scrd.is_valid())
+		return -1;
+	if (delay >= 0)
+		scrd.get_fixture().delay = delay;
+
+	if (load_file(name_in, input))
+		return -1;
+
+	fd_out = open(name_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd_out == -1) {
+		perror("open(out)");
+		fprintf(stderr, "Failed to open '%s'\n", name_out);
+		return -1;
+	}
+
+	for (int i = 0; i < repeat; i++) {
+		work = input;
+		if (lseek(fd_out, 0, SEEK_SET) == -1 && errno != ESPIPE)
+			perror("lseek(out)");
+
+		if (jobs > 0)
+			ret = bench_run_parallel(scrd, work, fd_out, jobs);
+		else
+			ret = bench_run(scrd, work, fd_out);
+		if (ret)
+			break;
+	}
+
+	close(fd_out);
+
+	return ret ? -1 : 0;
+}
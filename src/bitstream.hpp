@@ -3,6 +3,8 @@
 
 #include <cstdint>
 
+#include <algorithm>
+
 template <class RandomIterator>
 class bitstream {
 public:
@@ -114,6 +116,24 @@ public:
 		return result;
 	}
 
+	/**
+	 * Copy n bytes to out, faster than get_bits() if byte aligned.
+	 */
+	template <class OutputIterator>
+	void get_bytes(OutputIterator out, size_t n)
+	{
+		if (!is_align_byte()) {
+			for (size_t i = 0; i < n; i++)
+				*out++ = get_bits(8);
+			return;
+		}
+
+		RandomIterator st = buf + off + (pos >> 3);
+
+		std::copy(st, st + n, out);
+		skip(n);
+	}
+
 	void set_bits(size_t n, uint64_t val)
 	{
 		set_bits(position_bits(), n, val);
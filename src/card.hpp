@@ -0,0 +1,76 @@
+#ifndef CARD_HPP__
+#define CARD_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cinttypes>
+
+#include <string>
+#include <vector>
+
+class card_base {
+public:
+	card_base()
+	{
+	}
+
+	virtual ~card_base()
+	{
+	}
+
+	virtual int is_valid() = 0;
+	virtual int connect(size_t n) = 0;
+	virtual void disconnect() = 0;
+	virtual int transmit(void *buf_send, size_t nsend, void *buf_recv, size_t *nrecv) = 0;
+};
+
+class card_reader_base {
+public:
+	card_reader_base()
+	{
+	}
+
+	virtual ~card_reader_base()
+	{
+	}
+
+	virtual int is_valid() const = 0;
+	virtual int establish() = 0;
+	virtual void release() = 0;
+	virtual int enumerate_readers() = 0;
+	virtual const std::vector<std::string>& get_readers() const = 0;
+	virtual void dump() const = 0;
+
+	/**
+	 * Create the card which is connected through this reader.
+	 *
+	 * @return new card, caller must delete it
+	 */
+	virtual card_base *create_card() = 0;
+
+	/**
+	 * Create another reader which has own context, cards on
+	 * different contexts can be used from different threads
+	 * concurrently.
+	 *
+	 * @return new reader, caller must delete it
+	 */
+	virtual card_reader_base *create_reader() const = 0;
+
+	/**
+	 * Wait until readers are plugged or unplugged, or cards are
+	 * inserted or removed.
+	 *
+	 * @ms timeout in msec
+	 * @return 0 if changed, -ETIMEDOUT if timeout, -EINTR if canceled,
+	 *         or other negative error code
+	 */
+	virtual int wait_status_change(int ms) = 0;
+
+	/**
+	 * Cancel wait_status_change() from other thread.
+	 */
+	virtual void cancel() = 0;
+};
+
+#endif //CARD_HPP__
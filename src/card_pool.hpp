@@ -0,0 +1,556 @@
+#ifndef CARD_POOL_HPP__
+#define CARD_POOL_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "card.hpp"
+
+//Max number of cards which try same request
+#define CARD_POOL_RETRY          3
+//Interval of reconnecting if state of readers is not changed in msec
+#define CARD_POOL_RECONNECT      10000
+//Timeout of watching state of readers in msec
+#define CARD_POOL_STATUS         1000
+//Max size of response
+#define CARD_POOL_SIZE_RESPONSE  512
+//Max size of command, header, 255 bytes of ECM and length of response
+#define CARD_POOL_SIZE_COMMAND   (5 + 255 + 1)
+
+enum card_req_type {
+	CARD_REQ_INT,
+	CARD_REQ_ECM,
+};
+
+struct card_request {
+	card_request() :
+		type(CARD_REQ_ECM), pid(0x1fff), tag(0), len_cmd(0),
+		ns_submit(0), retry(0)
+	{
+	}
+
+	/**
+	 * Build INT command (INS 0x30).
+	 */
+	void set_int()
+	{
+		type = CARD_REQ_INT;
+		len_cmd = 5;
+		//CLA, INS, param 1, 2, length
+		cmd[0] = 0x90;
+		cmd[1] = 0x30;
+		cmd[2] = 0x00;
+		cmd[3] = 0x00;
+		cmd[4] = 0x00;
+	}
+
+	/**
+	 * Build ECM command (INS 0x34) in place of the fixed buffer,
+	 * no allocation per request.
+	 *
+	 * @body encrypted ECM, body of ECM section
+	 * @len  size of body, 255 or less
+	 */
+	void set_ecm(const uint8_t *body, size_t len)
+	{
+		type = CARD_REQ_ECM;
+		len_cmd = 5 + len + 1;
+		//CLA, INS, param 1, 2
+		cmd[0] = 0x90;
+		cmd[1] = 0x34;
+		cmd[2] = 0x00;
+		cmd[3] = 0x00;
+		//cmd length, encrypted ECM
+		cmd[4] = len;
+		memcpy(&cmd[5], body, len);
+		//res length
+		cmd[5 + len] = 0x00;
+	}
+
+	int type;
+	uint32_t pid;
+	//Passed from request to response as is
+	uint64_t tag;
+	uint8_t cmd[CARD_POOL_SIZE_COMMAND];
+	size_t len_cmd;
+	uint64_t ns_submit;
+	int retry;
+};
+
+struct card_response {
+	card_response() :
+		type(CARD_REQ_ECM), pid(0x1fff), tag(0), ret(0), card(0), ns_submit(0)
+	{
+	}
+
+	int type;
+	uint32_t pid;
+	//Same as the request
+	uint64_t tag;
+	int ret;
+	size_t card;
+	std::vector<uint8_t> res;
+	uint64_t ns_submit;
+};
+
+/**
+ * Cards of all enumerated readers.
+ *
+ * Each card has own reader context and worker thread. Idle worker
+ * takes the next request, so requests are dispatched by availability.
+ * If a card is invalidated by transmit(), its request is passed to
+ * other cards and the worker reconnects in the background.
+ *
+ * Worker sends INT command after every connection and posts the
+ * response before any ECM responses of the card.
+ *
+ * Manager thread keeps the context of given reader, watches plug and
+ * unplug of readers and cards, starts workers for new readers and
+ * wakes up disconnected workers to reconnect. Nothing about readers
+ * is done in the caller's thread.
+ */
+class card_pool {
+public:
+	card_pool() :
+		rd_main(NULL), running(false), scanned(false),
+		stopping(false), gen_status(0)
+	{
+	}
+
+	virtual ~card_pool()
+	{
+		stop();
+	}
+
+	bool is_running() const
+	{
+		return running;
+	}
+
+	size_t get_cards()
+	{
+		std::lock_guard<std::mutex> lk(mtx_workers);
+
+		return workers.size();
+	}
+
+	/**
+	 * Check whether requests may be answered.
+	 *
+	 * @return true if any card is connected or is connecting first time
+	 */
+	bool is_available()
+	{
+		std::lock_guard<std::mutex> lk(mtx_workers);
+
+		if (!scanned)
+			return true;
+		for (auto& w : workers) {
+			if (w->state != WORKER_LOST)
+				return true;
+		}
+
+		return false;
+	}
+
+	/**
+	 * Start the manager and workers, never block.
+	 *
+	 * @r reader, it is used by the manager thread until stop()
+	 */
+	int start(card_reader_base& r)
+	{
+		if (running)
+			return -EBUSY;
+
+		rd_main = &r;
+		scanned = false;
+		stopping = false;
+		th_manager = std::thread(&card_pool::run_manager, this);
+
+		running = true;
+
+		return 0;
+	}
+
+	void stop()
+	{
+		if (!running)
+			return;
+
+		{
+			std::lock_guard<std::mutex> lk(mtx_req);
+			stopping = true;
+		}
+		cond_req.notify_all();
+		{
+			//Context of the manager is not released while cancel
+			std::lock_guard<std::mutex> lk(mtx_main);
+			rd_main->cancel();
+		}
+
+		th_manager.join();
+		for (auto& w : workers)
+			w->th.join();
+		workers.clear();
+
+		running = false;
+	}
+
+	/**
+	 * Queue the request, the command is copied to the queue without
+	 * allocation.
+	 */
+	void submit(card_request& req)
+	{
+		{
+			std::lock_guard<std::mutex> lk(mtx_req);
+			reqs.push_back(std::move(req));
+		}
+		cond_req.notify_one();
+	}
+
+	/**
+	 * Get a response if exists, never block.
+	 *
+	 * @return true if got a response
+	 */
+	bool poll(card_response& rs)
+	{
+		std::lock_guard<std::mutex> lk(mtx_res);
+
+		if (resps.empty())
+			return false;
+
+		rs = std::move(resps.front());
+		resps.pop_front();
+
+		return true;
+	}
+
+	/**
+	 * Wait for a response.
+	 *
+	 * @ms timeout in msec
+	 * @return true if got a response
+	 */
+	bool wait(card_response& rs, int ms)
+	{
+		std::unique_lock<std::mutex> lk(mtx_res);
+
+		cond_res.wait_for(lk, std::chrono::milliseconds(ms),
+			[this] { return !resps.empty(); });
+		if (resps.empty())
+			return false;
+
+		rs = std::move(resps.front());
+		resps.pop_front();
+
+		return true;
+	}
+
+protected:
+	enum worker_state {
+		WORKER_CONNECTING,
+		WORKER_CONNECTED,
+		WORKER_LOST,
+	};
+
+	struct worker {
+		size_t index;
+		std::string name;
+		std::atomic<int> state;
+		std::shared_ptr<card_reader_base> reader;
+		std::shared_ptr<card_base> card;
+		std::thread th;
+		uint8_t buf_res[CARD_POOL_SIZE_RESPONSE];
+	};
+
+	int connect_worker(worker *w)
+	{
+		auto& rd = w->reader->get_readers();
+		size_t n;
+		int ret;
+
+		w->card.reset();
+		if (!w->reader->is_valid()) {
+			ret = w->reader->establish();
+			if (ret)
+				return ret;
+		}
+		ret = w->reader->enumerate_readers();
+		if (ret == -EIO) {
+			//Context may be broken, establish again at next time
+			w->reader->release();
+		}
+		if (ret)
+			return ret;
+
+		//Index of reader may be changed by plug or unplug
+		for (n = 0; n < rd.size(); n++) {
+			if (rd[n] == w->name)
+				break;
+		}
+		if (n == rd.size())
+			return -ENOENT;
+
+		w->card.reset(w->reader->create_card());
+
+		return w->card->connect(n);
+	}
+
+	void transmit(worker *w, card_request& req, card_response& rs)
+	{
+		size_t nrecv = sizeof(w->buf_res);
+
+		rs.type = req.type;
+		rs.pid = req.pid;
+		rs.tag = req.tag;
+		rs.card = w->index;
+		rs.ns_submit = req.ns_submit;
+
+		rs.ret = w->card->transmit(req.cmd, req.len_cmd,
+			w->buf_res, &nrecv);
+		if (rs.ret)
+			nrecv = 0;
+		rs.res.assign(w->buf_res, w->buf_res + nrecv);
+	}
+
+	bool is_stopping()
+	{
+		std::lock_guard<std::mutex> lk(mtx_req);
+
+		return stopping;
+	}
+
+	/**
+	 * Wait for changing state of readers or cards.
+	 *
+	 * @seen last known generation of state, updated
+	 * @ms   timeout in msec
+	 */
+	void sleep_status(uint64_t& seen, int ms)
+	{
+		std::unique_lock<std::mutex> lk(mtx_req);
+
+		cond_req.wait_for(lk, std::chrono::milliseconds(ms),
+			[this, seen] { return stopping || gen_status != seen; });
+		seen = gen_status;
+	}
+
+	void notify_status()
+	{
+		{
+			std::lock_guard<std::mutex> lk(mtx_req);
+			gen_status++;
+		}
+		cond_req.notify_all();
+	}
+
+	bool pop_request(card_request& req)
+	{
+		std::unique_lock<std::mutex> lk(mtx_req);
+
+		cond_req.wait_for(lk, std::chrono::milliseconds(100),
+			[this] { return stopping || !reqs.empty(); });
+		if (stopping || reqs.empty())
+			return false;
+
+		req = std::move(reqs.front());
+		reqs.pop_front();
+
+		return true;
+	}
+
+	void push_request_front(card_request& req)
+	{
+		{
+			std::lock_guard<std::mutex> lk(mtx_req);
+			reqs.push_front(std::move(req));
+		}
+		cond_req.notify_one();
+	}
+
+	void post(card_response& rs)
+	{
+		{
+			std::lock_guard<std::mutex> lk(mtx_res);
+			resps.push_back(std::move(rs));
+		}
+		cond_res.notify_all();
+	}
+
+	void add_workers(const std::vector<std::string>& names)
+	{
+		std::lock_guard<std::mutex> lk(mtx_workers);
+
+		for (auto& e : names) {
+			bool found = false;
+
+			for (auto& w : workers) {
+				if (w->name == e)
+					found = true;
+			}
+			if (found)
+				continue;
+
+			std::shared_ptr<worker> w(new worker);
+
+			printf("card: %s\n", e.c_str());
+
+			w->index = workers.size();
+			w->name = e;
+			w->state = WORKER_CONNECTING;
+			w->reader.reset(rd_main->create_reader());
+			w->th = std::thread(&card_pool::run_worker, this, w.get());
+			workers.push_back(w);
+		}
+	}
+
+	/**
+	 * Establish or release the context of the manager, stop() may
+	 * cancel the context from other thread.
+	 */
+	int establish_main()
+	{
+		std::lock_guard<std::mutex> lk(mtx_main);
+
+		return rd_main->establish();
+	}
+
+	void release_main()
+	{
+		std::lock_guard<std::mutex> lk(mtx_main);
+
+		rd_main->release();
+	}
+
+	void run_manager()
+	{
+		bool changed = true;
+		uint64_t seen = 0;
+		int ret;
+
+		while (!is_stopping()) {
+			if (!rd_main->is_valid() && establish_main()) {
+				scanned = true;
+				sleep_status(seen, CARD_POOL_STATUS);
+				continue;
+			}
+
+			if (changed) {
+				ret = rd_main->enumerate_readers();
+				if (ret == 0)
+					add_workers(rd_main->get_readers());
+				scanned = true;
+				notify_status();
+			}
+
+			//Cancelled by stop()
+			ret = rd_main->wait_status_change(CARD_POOL_STATUS);
+			changed = (ret == 0);
+			if (ret && ret != -ETIMEDOUT && ret != -EINTR) {
+				//Context may be broken (ex. pcscd is restarted)
+				release_main();
+				changed = true;
+				sleep_status(seen, CARD_POOL_STATUS);
+			}
+		}
+	}
+
+	void run_worker(worker *w)
+	{
+		bool reported = false;
+		uint64_t seen = 0;
+
+		while (!is_stopping()) {
+			if (!w->card || !w->card->is_valid()) {
+				card_request req;
+				card_response rs;
+
+				if (connect_worker(w)) {
+					if (!reported)
+						fprintf(stderr, "Cannot get smart card '%s'.\n",
+							w->name.c_str());
+					reported = true;
+					w->state = WORKER_LOST;
+					sleep_status(seen, CARD_POOL_RECONNECT);
+					continue;
+				}
+
+				req.set_int();
+				transmit(w, req, rs);
+				if (rs.ret || rs.res.size() == 0) {
+					if (!reported)
+						fprintf(stderr, "Cannot get initialize vector '%s'.\n",
+							w->name.c_str());
+					reported = true;
+					w->state = WORKER_LOST;
+					w->card.reset();
+					sleep_status(seen, CARD_POOL_RECONNECT);
+					continue;
+				}
+				post(rs);
+				reported = false;
+				w->state = WORKER_CONNECTED;
+			}
+
+			card_request req;
+			card_response rs;
+
+			if (!pop_request(req))
+				continue;
+
+			transmit(w, req, rs);
+			if (rs.ret && !w->card->is_valid()) {
+				w->state = WORKER_LOST;
+				//Fail over to other cards
+				req.retry++;
+				if (req.retry < CARD_POOL_RETRY) {
+					push_request_front(req);
+					continue;
+				}
+			}
+			post(rs);
+		}
+
+		w->card.reset();
+	}
+
+private:
+	card_reader_base *rd_main;
+	//Lock of establish, release and cancel of rd_main
+	std::mutex mtx_main;
+	std::thread th_manager;
+
+	std::mutex mtx_workers;
+	std::vector<std::shared_ptr<worker>> workers;
+	bool running;
+	std::atomic<bool> scanned;
+
+	std::mutex mtx_req;
+	std::condition_variable cond_req;
+	std::deque<card_request> reqs;
+	bool stopping;
+	//Generation of state of readers and cards
+	uint64_t gen_status;
+
+	std::mutex mtx_res;
+	std::condition_variable cond_res;
+	std::deque<card_response> resps;
+};
+
+#endif //CARD_POOL_HPP__
@@ -0,0 +1,436 @@
+#ifndef CARD_SCRIPT_HPP__
+#define CARD_SCRIPT_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "card.hpp"
+
+struct card_script_ecm {
+	std::vector<uint8_t> body;
+	uint64_t ks_odd;
+	uint64_t ks_even;
+};
+
+/**
+ * Synthetic keys of the scripted card.
+ *
+ * Text file, one entry per line, '#' starts a comment.
+ *
+ *   system_key <32 bytes in hex>
+ *   cbc_iv     <8 bytes in hex>
+ *   delay      <response delay in usec>
+ *   readers    <number of readers>
+ *   ecm        <ECM body in hex> <Ks odd in hex> <Ks even in hex>
+ */
+class card_script_fixture {
+public:
+	card_script_fixture() :
+		cbc_iv(0), delay(0), readers(1)
+	{
+		memset(system_key, 0, sizeof(system_key));
+	}
+
+	int load(const char *name)
+	{
+		char line[4096];
+		int lineno = 0;
+		FILE *f;
+
+		f = fopen(name, "r");
+		if (f == NULL) {
+			perror("fopen(fixture)");
+			fprintf(stderr, "Failed to open '%s'\n", name);
+			return -ENOENT;
+		}
+
+		ecms.clear();
+		while (fgets(line, sizeof(line), f)) {
+			std::vector<uint8_t> v;
+			char *cmt, *tok, *arg[3], *save;
+			int n;
+
+			lineno++;
+			cmt = strchr(line, '#');
+			if (cmt)
+				*cmt = '\0';
+
+			tok = strtok_r(line, " \t\r\n", &save);
+			if (tok == NULL)
+				continue;
+			for (n = 0; n < 3; n++) {
+				arg[n] = strtok_r(NULL, " \t\r\n", &save);
+				if (arg[n] == NULL)
+					break;
+			}
+
+			if (strcmp(tok, "system_key") == 0 && n >= 1 &&
+			    parse_hex(arg[0], v) == 0 &&
+			    v.size() == sizeof(system_key)) {
+				memcpy(system_key, &v[0], sizeof(system_key));
+			} else if (strcmp(tok, "cbc_iv") == 0 && n >= 1) {
+				cbc_iv = strtoull(arg[0], NULL, 16);
+			} else if (strcmp(tok, "delay") == 0 && n >= 1) {
+				delay = strtoul(arg[0], NULL, 0);
+			} else if (strcmp(tok, "readers") == 0 && n >= 1) {
+				readers = strtoul(arg[0], NULL, 0);
+			} else if (strcmp(tok, "ecm") == 0 && n >= 3 &&
+				   parse_hex(arg[0], v) == 0 &&
+				   v.size() > 0 && v.size() <= 250) {
+				card_script_ecm e;
+
+				e.body = v;
+				e.ks_odd = strtoull(arg[1], NULL, 16);
+				e.ks_even = strtoull(arg[2], NULL, 16);
+				ecms.push_back(e);
+			} else {
+				fprintf(stderr, "%s:%d: invalid line.\n",
+					name, lineno);
+				fclose(f);
+				return -EINVAL;
+			}
+		}
+
+		fclose(f);
+
+		if (ecms.size() == 0) {
+			fprintf(stderr, "%s: no ECM entries.\n", name);
+			return -EINVAL;
+		}
+
+		return 0;
+	}
+
+	const card_script_ecm *find_ecm(const uint8_t *body, size_t len) const
+	{
+		for (auto& e : ecms) {
+			if (e.body.size() == len &&
+			    memcmp(&e.body[0], body, len) == 0)
+				return &e;
+		}
+
+		return NULL;
+	}
+
+	static int parse_hex(const char *s, std::vector<uint8_t>& v)
+	{
+		size_t len = strlen(s);
+
+		v.clear();
+		if (len % 2)
+			return -EINVAL;
+
+		for (size_t i = 0; i < len; i += 2) {
+			char b[3] = {s[i], s[i + 1], '\0'};
+			char *e;
+
+			v.push_back(strtoul(b, &e, 16));
+			if (*e != '\0')
+				return -EINVAL;
+		}
+
+		return 0;
+	}
+
+public:
+	uint8_t system_key[32];
+	uint64_t cbc_iv;
+	uint32_t delay;
+	uint32_t readers;
+	std::vector<card_script_ecm> ecms;
+};
+
+/**
+ * Test double of the smart card, it answers INT (0x30) and
+ * ECM (0x34) commands from the fixture.
+ */
+class card_script : public card_base {
+public:
+	card_script(const card_script_fixture& f) :
+		fixture(f), valid(0)
+	{
+	}
+
+	virtual ~card_script()
+	{
+		disconnect();
+	}
+
+	int is_valid()
+	{
+		return valid;
+	}
+
+	int connect(size_t n)
+	{
+		if (valid || n >= fixture.readers)
+			return -ENOENT;
+
+		valid = 1;
+
+		return 0;
+	}
+
+	void disconnect()
+	{
+		valid = 0;
+	}
+
+	int transmit(void *buf_send, size_t nsend, void *buf_recv, size_t *nrecv)
+	{
+		uint8_t *snd = (uint8_t *)buf_send;
+		uint8_t res[256];
+		size_t len;
+
+		if (!valid)
+			return -EBADF;
+		if (nsend < 5 || snd[0] != 0x90)
+			return -EINVAL;
+
+		if (fixture.delay)
+			usleep(fixture.delay);
+
+		switch (snd[1]) {
+		case 0x30:
+			len = response_int(res);
+			break;
+		case 0x34:
+			if (nsend < (size_t)snd[4] + 5)
+				return -EINVAL;
+			len = response_ecm(&snd[5], snd[4], res);
+			break;
+		default:
+			len = response_sw(res, 0, 0x6d, 0x00);
+			break;
+		}
+
+		if (len > *nrecv)
+			len = *nrecv;
+		memcpy(buf_recv, res, len);
+		*nrecv = len;
+
+		return 0;
+	}
+
+protected:
+	size_t response_int(uint8_t *res)
+	{
+		size_t pos;
+
+		//protocol unit number, unit length,
+		//IC card instruction, return code
+		pos = put_header(res, 0x0000, 0x2100);
+		//CA system ID
+		pos = put_be(res, pos, 0x0005, 2);
+		//card ID, card type, message partition length
+		pos = put_be(res, pos, 0x000000000001ULL, 6);
+		pos = put_be(res, pos, 0x01, 1);
+		pos = put_be(res, pos, 0x50, 1);
+		memcpy(&res[pos], fixture.system_key, sizeof(fixture.system_key));
+		pos += sizeof(fixture.system_key);
+		pos = put_be(res, pos, fixture.cbc_iv, 8);
+		//system management ID count
+		pos = put_be(res, pos, 0, 1);
+
+		return response_sw(res, pos, 0x90, 0x00);
+	}
+
+	size_t response_ecm(const uint8_t *body, size_t len, uint8_t *res)
+	{
+		const card_script_ecm *e = fixture.find_ecm(body, len);
+		size_t pos;
+
+		if (e) {
+			pos = put_header(res, 0x0000, 0x0800);
+			pos = put_be(res, pos, e->ks_odd, 8);
+			pos = put_be(res, pos, e->ks_even, 8);
+		} else {
+			//not contracted
+			pos = put_header(res, 0x0000, 0xa102);
+			pos = put_be(res, pos, 0, 8);
+			pos = put_be(res, pos, 0, 8);
+		}
+		//recording control
+		pos = put_be(res, pos, 0x00, 1);
+
+		return response_sw(res, pos, 0x90, 0x00);
+	}
+
+	size_t put_header(uint8_t *res, uint32_t inst, uint32_t ret)
+	{
+		size_t pos = 0;
+
+		pos = put_be(res, pos, 0x00, 1);
+		//unit length is filled by response_sw()
+		pos = put_be(res, pos, 0x00, 1);
+		pos = put_be(res, pos, inst, 2);
+		pos = put_be(res, pos, ret, 2);
+
+		return pos;
+	}
+
+	size_t response_sw(uint8_t *res, size_t pos, uint8_t sw1, uint8_t sw2)
+	{
+		if (pos >= 2)
+			res[1] = pos - 2;
+
+		res[pos++] = sw1;
+		res[pos++] = sw2;
+
+		return pos;
+	}
+
+	size_t put_be(uint8_t *res, size_t pos, uint64_t v, size_t n)
+	{
+		for (size_t i = 0; i < n; i++)
+			res[pos + i] = v >> ((n - i - 1) * 8);
+
+		return pos + n;
+	}
+
+private:
+	const card_script_fixture& fixture;
+	int valid;
+};
+
+class card_reader_script : public card_reader_base {
+public:
+	card_reader_script(const char *name) :
+		name_fixture(name), loaded(0), valid(0), canceled(false)
+	{
+		establish();
+	}
+
+	card_reader_script(const card_reader_script& r) :
+		name_fixture(r.name_fixture), fixture(r.fixture),
+		name_readers(r.name_readers), loaded(r.loaded), valid(r.valid),
+		canceled(false)
+	{
+	}
+
+	virtual ~card_reader_script()
+	{
+		release();
+	}
+
+	int is_valid() const
+	{
+		return valid;
+	}
+
+	card_script_fixture& get_fixture()
+	{
+		return fixture;
+	}
+
+	int establish()
+	{
+		int ret;
+
+		if (valid)
+			return -EBUSY;
+
+		//Keep the fixture which may be modified by get_fixture()
+		if (!loaded) {
+			ret = fixture.load(name_fixture.c_str());
+			if (ret)
+				return ret;
+			loaded = 1;
+		}
+
+		valid = 1;
+
+		return 0;
+	}
+
+	void release()
+	{
+		valid = 0;
+	}
+
+	int enumerate_readers()
+	{
+		name_readers.clear();
+
+		if (!valid) {
+			fprintf(stderr, "No cards.\n");
+			return -ENOENT;
+		}
+
+		for (uint32_t i = 0; i < fixture.readers; i++)
+			name_readers.push_back("script:" + name_fixture +
+				"#" + std::to_string(i));
+
+		return 0;
+	}
+
+	const std::vector<std::string>& get_readers() const
+	{
+		return name_readers;
+	}
+
+	void dump() const
+	{
+		for (auto& e : name_readers) {
+			printf("card: %s\n", e.c_str());
+		}
+	}
+
+	card_base *create_card()
+	{
+		return new card_script(fixture);
+	}
+
+	card_reader_base *create_reader() const
+	{
+		return new card_reader_script(*this);
+	}
+
+	int wait_status_change(int ms)
+	{
+		std::unique_lock<std::mutex> lk(mtx_cancel);
+
+		//Scripted readers and cards never change
+		if (cond_cancel.wait_for(lk, std::chrono::milliseconds(ms),
+				[this] { return canceled; })) {
+			canceled = false;
+			return -EINTR;
+		}
+
+		return -ETIMEDOUT;
+	}
+
+	void cancel()
+	{
+		{
+			std::lock_guard<std::mutex> lk(mtx_cancel);
+			canceled = true;
+		}
+		cond_cancel.notify_all();
+	}
+
+private:
+	std::string name_fixture;
+	card_script_fixture fixture;
+	std::vector<std::string> name_readers;
+	int loaded;
+	int valid;
+
+	std::mutex mtx_cancel;
+	std::condition_variable cond_cancel;
+	bool canceled;
+};
+
+#endif //CARD_SCRIPT_HPP__
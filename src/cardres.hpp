@@ -43,6 +43,31 @@ public:
 	{
 	}
 
+	/**
+	 * Read the header from fixed position.
+	 *
+	 * @return size of header
+	 */
+	size_t read_fixed_header(const uint8_t *buf)
+	{
+		protocol_unit_number = buf[0];
+		unit_length          = buf[1];
+		ic_card_instruction  = get_be(&buf[2], 2);
+		return_code          = get_be(&buf[4], 2);
+
+		return 6;
+	}
+
+	static uint64_t get_be(const uint8_t *buf, size_t n)
+	{
+		uint64_t v = 0;
+
+		for (size_t i = 0; i < n; i++)
+			v = (v << 8) | buf[i];
+
+		return v;
+	}
+
 	virtual void dump()
 	{
 		printf(FORMAT_STRING
@@ -37,6 +37,56 @@ public:
 		sw2               = bs.get_bits(8);
 	}
 
+	/**
+	 * Read the response which has fixed layout without bitstream.
+	 *
+	 * @buf response of card
+	 * @len size of buf
+	 * @return 0 if success, -EINVAL if response is too short
+	 */
+	int read_fixed(const uint8_t *buf, size_t len)
+	{
+		size_t pos;
+
+		//header, Ks odd, Ks even, recording control, SW1, SW2
+		if (len < 6 + 8 + 8 + 1 + 2) {
+			set_error(EINVAL, "response too short, len:%d", (int)len);
+			return -EINVAL;
+		}
+
+		pos = read_fixed_header(buf);
+		ks_odd            = get_be(&buf[pos], 8);
+		ks_even           = get_be(&buf[pos + 8], 8);
+		recording_control = buf[pos + 16];
+		sw1               = buf[pos + 17];
+		sw2               = buf[pos + 18];
+
+		return 0;
+	}
+
+	/**
+	 * Check the card returned keys.
+	 *
+	 * @return true if SW is 0x9000 and return_code is one of
+	 *         purchased, tier or prepaid, otherwise keys are invalid
+	 */
+	bool is_success() const
+	{
+		if (sw1 != 0x90 || sw2 != 0x00)
+			return false;
+
+		switch (return_code) {
+		case 0x0200:
+		case 0x0400:
+		case 0x0800:
+		case 0x4280:
+		case 0x4480:
+			return true;
+		}
+
+		return false;
+	}
+
 	virtual const packet::stub_base__write& get_write_stub() const
 	{
 		static const packet::stub_derived__write<cardres_ecm> s;
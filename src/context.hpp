@@ -0,0 +1,966 @@
+#ifndef CONTEXT_HPP__
+#define CONTEXT_HPP__
+
+#include <cstdio>
+#include <cstdint>
+#include <cinttypes>
+#include <cstring>
+#include <ctime>
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include "packet_ts.hpp"
+#include "psi_pat.hpp"
+#include "psi_pmt.hpp"
+#include "psi_ecm.hpp"
+#include "card.hpp"
+#include "card_pool.hpp"
+#include "cardres_int.hpp"
+#include "cardres_ecm.hpp"
+#include "descrambler_ts.hpp"
+#include "ecm_cache.hpp"
+#include "service_filter.hpp"
+
+#define SIZE_TS          188
+#define SIZE_TS_CHUNK    (188 * 7)
+//Max time to wait for keys of ECM in msec
+#define ECM_TIMEOUT      3000
+//Max size of held packets of a PID, must be larger than a chunk.
+//About HOLD_TIMEOUT of a 32Mbps PID
+#define HOLD_SIZE        (188 * 65536)
+//Max time to hold packets in msec
+#define HOLD_TIMEOUT     ECM_TIMEOUT
+
+/**
+ * Packets of a PID which are waiting for the keys.
+ */
+struct hold_ts {
+	std::vector<char> buf;
+	uint64_t ns_limit;
+};
+
+struct context;
+typedef std::function<int(context&, payload_ts&)> func_payload;
+
+inline int proc_pat(context& c, payload_ts& pay);
+inline int proc_pmt(context& c, payload_ts& pay);
+inline int proc_ecm(context& c, payload_ts& pay);
+
+struct context {
+	context() :
+		scrd(NULL),
+		cnt_ecm_pending(0),
+		valid_descrambler(0),
+		cnt_ecm_card(0),
+		ns_ecm_card_sum(0),
+		ns_ecm_card_max(0),
+		cnt_held(0),
+		cnt_hold_timeout(0),
+		cnt_hold_overflow(0),
+		psi_ready(false),
+		ns_start(0),
+		ns_card_ready(0),
+		ns_first_clear(0)
+	{
+		for (int i = 0; i < 0x2000; i++) {
+			es_ecm[i] = 0x1fff;
+			ns_ecm_applied[i] = 0;
+			last_tsc[i] = 0;
+			ecm_refs[i] = 0;
+			es_type[i] = 0;
+		}
+	}
+
+	void set_card_reader(card_reader_base *r)
+	{
+		scrd = r;
+	}
+
+	/**
+	 * Add the filter of an output. PAT and PMT are notified to it,
+	 * and its programs are descrambled.
+	 */
+	void add_output_filter(service_filter *f, uint32_t program_number)
+	{
+		filters_out.push_back(f);
+		f->add_program(program_number);
+		filter_service.add_program(program_number);
+	}
+
+	void update_filters_pat(const psi_pat& pat)
+	{
+		filter_service.update_pat(pat);
+		for (auto f : filters_out)
+			f->update_pat(pat);
+	}
+
+	void update_filters_pmt(uint32_t pid, const psi_pmt& pmt)
+	{
+		filter_service.update_pmt(pid, pmt);
+		for (auto f : filters_out)
+			f->update_pmt(pid, pmt);
+	}
+
+	void reset_ts_filter()
+	{
+		map_filter.clear();
+
+		map_filter.insert(std::make_pair(0, proc_pat));
+	}
+
+	void add_ts_filter(uint32_t pid, func_payload f)
+	{
+		map_filter.insert(std::make_pair(pid, f));
+	}
+
+	void remove_ts_filter(uint32_t pid)
+	{
+		map_filter.erase(pid);
+	}
+
+	/**
+	 * Get PIDs of PMT of the programs to descramble.
+	 */
+	void get_pmt_pids(const psi_pat& pat, std::set<uint32_t>& pids)
+	{
+		for (auto& e : pat.progs) {
+			if (e.program_number == 0)
+				continue;
+			//No need to descramble programs which are not output
+			if (filter_service.is_enabled() &&
+			    !filter_service.is_selected(e.program_number))
+				continue;
+
+			pids.insert(e.program_map_id);
+		}
+	}
+
+	/**
+	 * Apply the difference of PAT, filters of unchanged PMTs are kept
+	 * with their ECMs.
+	 */
+	void update_pmt_filters(const psi_pat& pat_old, const psi_pat& pat_new)
+	{
+		std::set<uint32_t> pids_old, pids_new;
+
+		get_pmt_pids(pat_old, pids_old);
+		get_pmt_pids(pat_new, pids_new);
+
+		for (auto pid : pids_old) {
+			if (pids_new.count(pid) == 0)
+				remove_pmt_filter(pid);
+		}
+
+		for (auto& e : pat_new.progs) {
+			if (pids_new.count(e.program_map_id) == 0 ||
+			    pids_old.count(e.program_map_id) != 0)
+				continue;
+
+			printf("--PMT prg:%5d(0x%04x) pid:0x%04x\n",
+				e.program_number, e.program_number,
+				e.program_map_id);
+			add_pmt_filter(e.program_map_id);
+			//Same PMT may be shared by programs
+			pids_old.insert(e.program_map_id);
+		}
+	}
+
+	/**
+	 * Check PAT and all PMTs of programs to descramble are received.
+	 * ES which are not mapped to ECM until then may be mapped later.
+	 */
+	void update_psi_ready()
+	{
+		std::set<uint32_t> pids;
+
+		psi_ready = false;
+		if (last_pat.version_number == (uint32_t)-1)
+			return;
+
+		get_pmt_pids(last_pat, pids);
+		for (auto pid : pids) {
+			if (last_pmt[pid].version_number == (uint32_t)-1)
+				return;
+		}
+		psi_ready = true;
+	}
+
+	void add_pmt_filter(uint32_t pid)
+	{
+		last_pmt[pid].version_number = -1;
+
+		add_ts_filter(pid, proc_pmt);
+	}
+
+	void remove_pmt_filter(uint32_t pid)
+	{
+		psi_pmt& pmt = last_pmt[pid];
+		psi_pmt none;
+
+		remove_ts_filter(pid);
+
+		update_ecm_filters(pmt, none);
+		update_es_ecm(pmt, none);
+		pmt = none;
+	}
+
+	/**
+	 * Get PIDs of ECM of the program and of each ES.
+	 */
+	static void get_ecm_pids(const psi_pmt& pmt, std::set<uint32_t>& pids)
+	{
+		for (auto& e : pmt.descs) {
+			if (e->descriptor_tag != DESC_CA)
+				continue;
+
+			pids.insert(dynamic_cast<const desc_ca&>(*e).ca_pid);
+		}
+		for (auto& es : pmt.esinfos) {
+			for (auto& e : es.descs) {
+				if (e->descriptor_tag != DESC_CA)
+					continue;
+
+				pids.insert(dynamic_cast<const desc_ca&>(*e).ca_pid);
+			}
+		}
+		pids.erase(0x1fff);
+	}
+
+	/**
+	 * Apply the difference of ECM PIDs of a PMT. ECM filters are
+	 * counted by PMTs, so unchanged ECM keeps its version and keys,
+	 * and is not sent to the card again.
+	 */
+	void update_ecm_filters(const psi_pmt& pmt_old, const psi_pmt& pmt_new)
+	{
+		std::set<uint32_t> pids_old, pids_new;
+
+		get_ecm_pids(pmt_old, pids_old);
+		get_ecm_pids(pmt_new, pids_new);
+
+		for (auto pid : pids_new) {
+			if (pids_old.count(pid) != 0)
+				continue;
+
+			if (ecm_refs[pid]++ == 0) {
+				printf("  --ECM pid:0x%04x\n", pid);
+				add_ecm_filter(pid);
+			}
+		}
+		for (auto pid : pids_old) {
+			if (pids_new.count(pid) != 0 || ecm_refs[pid] == 0)
+				continue;
+
+			if (--ecm_refs[pid] == 0)
+				remove_ecm_filter(pid);
+		}
+	}
+
+	/**
+	 * Update ECM of each ES. If ES is moved to the ECM which already
+	 * has keys, the keys are given to ES without waiting next ECM.
+	 */
+	void update_es_ecm(const psi_pmt& pmt_old, const psi_pmt& pmt_new)
+	{
+		std::map<uint32_t, uint32_t> ecm_prev;
+		uint32_t default_ecm = 0x1fff;
+
+		for (auto& e : pmt_new.esinfos)
+			ecm_prev[e.elementary_pid] = es_ecm[e.elementary_pid];
+		for (auto& e : pmt_old.esinfos) {
+			es_ecm[e.elementary_pid] = 0x1fff;
+			es_type[e.elementary_pid] = 0;
+		}
+
+		for (auto& e : pmt_new.descs) {
+			if (e->descriptor_tag != DESC_CA)
+				continue;
+
+			default_ecm = dynamic_cast<const desc_ca&>(*e).ca_pid;
+		}
+
+		for (auto& e : pmt_new.esinfos) {
+			uint32_t pid = e.elementary_pid;
+			uint32_t pid_ecm = default_ecm;
+
+			for (auto& e_es : e.descs) {
+				if (e_es->descriptor_tag != DESC_CA)
+					continue;
+
+				const desc_ca& dsc_es = dynamic_cast<const desc_ca&>(*e_es);
+
+				if (dsc_es.ca_pid != 0x1fff)
+					pid_ecm = dsc_es.ca_pid;
+			}
+			es_ecm[pid] = pid_ecm;
+			es_type[pid] = e.stream_type;
+
+			if (pid_ecm != 0x1fff && pid_ecm != ecm_prev[pid] &&
+			    ns_ecm_applied[pid_ecm]) {
+				cardres_ecm& res = last_res_ecm[pid_ecm];
+
+				descrambler[pid].set_data_key_odd(res.ks_odd);
+				descrambler[pid].set_data_key_even(res.ks_even);
+			}
+
+			printf("  --ES type:0x%04x pid:0x%04x ecm:0x%04x\n",
+				e.stream_type, pid, pid_ecm);
+		}
+	}
+
+	void add_ecm_filter(uint32_t pid)
+	{
+		last_ecm[pid].version_number = -1;
+
+		add_ts_filter(pid, proc_ecm);
+	}
+
+	void remove_ecm_filter(uint32_t pid)
+	{
+		remove_ts_filter(pid);
+	}
+
+	/**
+	 * Start connecting cards and getting system key in background,
+	 * so the card is ready before PAT, PMT and ECM are arrived.
+	 */
+	void start()
+	{
+		ns_start = get_time_ns();
+		init_card_pool();
+	}
+
+	/**
+	 * Report the startup latency at the first descrambled packet.
+	 */
+	void set_first_clear()
+	{
+		ns_first_clear = get_time_ns();
+
+		printf("first descrambled packet: %.3f ms",
+			(double)(ns_first_clear - ns_start) / 1000000);
+		if (ns_card_ready)
+			printf(" (card ready: %.3f ms)",
+				(double)(ns_card_ready - ns_start) / 1000000);
+		printf("\n");
+	}
+
+	void init_card_pool()
+	{
+		int ret;
+
+		if (!scrd || pool.is_running())
+			return;
+
+		ret = pool.start(*scrd);
+		if (ret)
+			fprintf(stderr, "Cannot get smart card.\n");
+	}
+
+	void apply_int(card_response& rs)
+	{
+		if (rs.ret || rs.res.size() == 0)
+			return;
+
+		bitstream<std::vector<uint8_t>::iterator> bs(rs.res.begin(), 0, rs.res.size());
+		cardres_int crint;
+		uint8_t *key;
+		uint64_t iv;
+
+		crint.read(bs);
+		key = crint.descrambling_system_key;
+		iv = crint.descrambler_cbc_initial_value;
+
+		for (int i = 0; i < 0x2000; i++) {
+			descrambler[i].set_system_key(key);
+			descrambler[i].set_init_vector(iv);
+		}
+		valid_descrambler = 1;
+		if (!ns_card_ready)
+			ns_card_ready = get_time_ns();
+
+		printf("card: #%d\n", (int)rs.card);
+		crint.dump();
+	}
+
+	/**
+	 * Set keys of ECM to ES which use the ECM.
+	 *
+	 * @pid       PID of ECM
+	 * @ns_submit time of the request
+	 * @res       response of card, NULL if the card did not answer
+	 */
+	void set_ecm_keys(uint32_t pid, uint64_t ns_submit, const cardres_ecm *res)
+	{
+		cardres_ecm& res_last = last_res_ecm[pid];
+
+		remove_ecm_pending(pid, ns_submit);
+
+		//Response of older ECM may be arrived later from other card
+		if (ns_submit < ns_ecm_applied[pid])
+			return;
+		ns_ecm_applied[pid] = ns_submit;
+
+		if (res)
+			res_last = *res;
+
+		for (int i = 0; i < 0x2000; i++) {
+			if (es_ecm[i] != pid)
+				continue;
+
+			descrambler[i].set_data_key_odd(res_last.ks_odd);
+			descrambler[i].set_data_key_even(res_last.ks_even);
+
+			//printf("  --ES change key pid:0x%04x ecm:0x%04x\n",
+			//	i, es_ecm[i]);
+		}
+
+		uint64_t ns_card = get_time_ns() - ns_submit;
+
+		cnt_ecm_card++;
+		ns_ecm_card_sum += ns_card;
+		if (ns_card > ns_ecm_card_max)
+			ns_ecm_card_max = ns_card;
+	}
+
+	void apply_ecm(card_response& rs)
+	{
+		std::vector<ecm_cache_waiter> waiters;
+		cardres_ecm res_ecm;
+		bool valid = false;
+		int ret;
+
+		//Errors of card, such as not contracted, are not cached
+		if (!rs.ret &&
+		    res_ecm.read_fixed(rs.res.data(), rs.res.size()) == 0)
+			valid = res_ecm.is_success();
+		//res_ecm.dump();
+
+		//Late answer of the request which is already submitted again,
+		//its waiters are taken over by the new request
+		ret = cache_ecm.complete(rs.tag, valid, res_ecm,
+			get_time_ns(), waiters);
+		if (ret)
+			return;
+
+		for (auto& e : waiters)
+			set_ecm_keys(e.pid, e.ns_submit, valid ? &res_ecm : NULL);
+	}
+
+	void apply_card_response(card_response& rs)
+	{
+		switch (rs.type) {
+		case CARD_REQ_INT:
+			apply_int(rs);
+			break;
+		case CARD_REQ_ECM:
+			apply_ecm(rs);
+			break;
+		}
+	}
+
+	/**
+	 * Apply all arrived responses of cards, never block.
+	 * Requests which are not answered in ECM_TIMEOUT are given up.
+	 */
+	void poll_card()
+	{
+		card_response rs;
+
+		while (pool.poll(rs))
+			apply_card_response(rs);
+		expire_ecm_pending(get_time_ns());
+	}
+
+	void add_ecm_pending(uint32_t pid, uint64_t ns_submit)
+	{
+		ecm_pending[pid].push_back(ns_submit);
+		cnt_ecm_pending++;
+	}
+
+	void remove_ecm_pending(uint32_t pid, uint64_t ns_submit)
+	{
+		std::vector<uint64_t>& v = ecm_pending[pid];
+		auto it = std::find(v.begin(), v.end(), ns_submit);
+
+		//Already expired
+		if (it == v.end())
+			return;
+
+		v.erase(it);
+		cnt_ecm_pending--;
+	}
+
+	/**
+	 * Give up requests which are not answered in time, for example
+	 * the card is removed while processing the request.
+	 *
+	 * @ns_now current time
+	 */
+	void expire_ecm_pending(uint64_t ns_now)
+	{
+		uint64_t ns_timeout = (uint64_t)ECM_TIMEOUT * 1000000;
+
+		if (cnt_ecm_pending == 0)
+			return;
+
+		for (uint32_t pid = 0; pid < 0x2000; pid++) {
+			std::vector<uint64_t>& v = ecm_pending[pid];
+			size_t n = v.size();
+
+			v.erase(std::remove_if(v.begin(), v.end(),
+				[=](uint64_t t) { return ns_now >= t + ns_timeout; }),
+				v.end());
+			if (v.size() == n)
+				continue;
+
+			fprintf(stderr, "Timeout of ECM pid:0x%04x.\n", pid);
+			cnt_ecm_pending -= n - v.size();
+		}
+	}
+
+	void clear_ecm_pending(uint32_t pid)
+	{
+		cnt_ecm_pending -= ecm_pending[pid].size();
+		ecm_pending[pid].clear();
+	}
+
+	/**
+	 * Wait for keys of the ECM, used only at the end of input.
+	 * Packets are never blocked by the card while processing.
+	 *
+	 * @pid PID of ECM
+	 */
+	void wait_ecm(uint32_t pid)
+	{
+		card_response rs;
+
+		while (!ecm_pending[pid].empty()) {
+			if (!pool.is_available()) {
+				//No cards, pass through scrambled packets
+				clear_ecm_pending(pid);
+				break;
+			}
+
+			if (pool.wait(rs, 100))
+				apply_card_response(rs);
+			expire_ecm_pending(get_time_ns());
+		}
+	}
+
+	static uint64_t get_time_ns()
+	{
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+
+public:
+	std::map<uint32_t, func_payload> map_filter;
+	payload_ts payloads[0x2000];
+	psi_pat last_pat;
+	psi_pmt last_pmt[0x2000];
+	psi_ecm last_ecm[0x2000];
+	//Number of PMTs which refer the ECM
+	int ecm_refs[0x2000];
+	uint32_t es_ecm[0x2000];
+	//Stream type of ES, 0 if not ES
+	uint32_t es_type[0x2000];
+	cardres_ecm last_res_ecm[0x2000];
+	//Union of all outputs
+	service_filter filter_service;
+	std::vector<service_filter *> filters_out;
+
+	card_reader_base *scrd;
+	card_pool pool;
+	ecm_cache cache_ecm;
+	//Submit time of ECM requests which are not answered
+	std::vector<uint64_t> ecm_pending[0x2000];
+	size_t cnt_ecm_pending;
+	uint64_t ns_ecm_applied[0x2000];
+	uint32_t last_tsc[0x2000];
+	//PID -> packets waiting for the keys
+	std::map<uint32_t, hold_ts> holds;
+	//Held packets which are released, output before the chunk
+	std::vector<char> buf_released;
+
+	descrambler_ts descrambler[0x2000];
+	int valid_descrambler;
+
+	//Time of ECM card round trip until keys are set
+	uint64_t cnt_ecm_card;
+	uint64_t ns_ecm_card_sum;
+	uint64_t ns_ecm_card_max;
+	//Packets which are held, and released by timeout
+	uint64_t cnt_held;
+	uint64_t cnt_hold_timeout;
+	uint64_t cnt_hold_overflow;
+	//PAT and all PMTs to descramble are received
+	bool psi_ready;
+	//Startup latency, time of start(), INT and first clear packet
+	uint64_t ns_start;
+	uint64_t ns_card_ready;
+	uint64_t ns_first_clear;
+};
+
+inline int proc_ts(context& c, packet_ts& ts)
+{
+	if (ts.is_error())
+		return 0;
+
+	auto it = c.map_filter.find(ts.pid);
+	if (it == c.map_filter.end())
+		return 0;
+
+	payload_ts& p = c.payloads[ts.pid];
+
+	p.add_ts(ts);
+
+	if (!p.is_valid() || !ts.payload_unit_start_indicator)
+		return 0;
+	if (p.get_payload().size() == 0)
+		return 0;
+
+	it->second(c, p);
+
+	return 0;
+}
+
+inline int proc_pat(context& c, payload_ts& pay)
+{
+	auto& buf = pay.get_payload();
+	bitstream<std::vector<uint8_t>::iterator> bs(buf.begin(), 0, buf.size());
+	psi_pat& last_pat = c.last_pat;
+	psi_pat pat;
+
+	pat.read(bs);
+	if (pat.is_error()) {
+		pat.print_error(stderr);
+		return 0;
+	}
+
+	if (last_pat.version_number == pat.version_number)
+		return 0;
+
+	printf("PAT ver.%2d\n", pat.version_number);
+
+	c.update_filters_pat(pat);
+	c.update_pmt_filters(last_pat, pat);
+	last_pat = pat;
+	c.update_psi_ready();
+
+	//pat.dump();
+
+	return 0;
+}
+
+inline int proc_pmt(context& c, payload_ts& pay)
+{
+	auto& buf = pay.get_payload();
+	packet_ts& ts = pay.get_first_ts();
+	bitstream<std::vector<uint8_t>::iterator> bs(buf.begin(), 0, buf.size());
+	psi_pmt& last_pmt = c.last_pmt[ts.pid];
+	psi_pmt pmt;
+
+	pmt.read(bs);
+	if (pmt.is_error()) {
+		pmt.print_error(stderr);
+		return 0;
+	}
+
+	if (last_pmt.version_number == pmt.version_number)
+		return 0;
+
+	printf("  PMT ver.%2d prg:%5d(0x%04x) pid:0x%04x\n", pmt.version_number,
+		pmt.program_number, pmt.program_number, ts.pid);
+
+	//Apply only the difference, unchanged ECMs keep their keys
+	c.update_ecm_filters(last_pmt, pmt);
+	c.update_es_ecm(last_pmt, pmt);
+	last_pmt = pmt;
+	c.update_psi_ready();
+
+	c.update_filters_pmt(ts.pid, pmt);
+
+	//pmt.dump();
+
+	return 0;
+}
+
+inline int proc_ecm(context& c, payload_ts& pay)
+{
+	auto& buf = pay.get_payload();
+	packet_ts& ts = pay.get_first_ts();
+	bitstream<std::vector<uint8_t>::iterator> bs(buf.begin(), 0, buf.size());
+	psi_ecm& last_ecm = c.last_ecm[ts.pid];
+	psi_ecm ecm;
+
+	ecm.read(bs);
+	if (ecm.is_error()) {
+		ecm.print_error(stderr);
+		return 0;
+	}
+
+	if (last_ecm.version_number == ecm.version_number)
+		return 0;
+	if (ecm.body.size() > 255) {
+		fprintf(stderr, "ECM body too large, len:%d\n",
+			(int)ecm.body.size());
+		return 0;
+	}
+
+	printf("  ECM ver.%2d pid:0x%04x\n", ecm.version_number,
+		ts.pid);
+	last_ecm = ecm;
+
+	c.init_card_pool();
+
+	if (c.pool.is_running()) {
+		uint64_t ns_now = c.get_time_ns();
+		uint64_t ns_limit = ns_now + (uint64_t)ECM_TIMEOUT * 1000000;
+		cardres_ecm res_ecm;
+		card_request req;
+		int ret;
+
+		c.add_ecm_pending(ts.pid, ns_now);
+
+		ret = c.cache_ecm.lookup(ecm.body, ts.pid, ns_now, ns_limit,
+			res_ecm, req.tag);
+		switch (ret) {
+		case ECM_CACHE_HIT:
+			c.set_ecm_keys(ts.pid, ns_now, &res_ecm);
+			break;
+		case ECM_CACHE_PENDING:
+			//keys are set when the card answers to same ECM
+			break;
+		case ECM_CACHE_MISS:
+			req.pid = ts.pid;
+			req.set_ecm(ecm.body.data(), ecm.body.size());
+			req.ns_submit = ns_now;
+
+			c.pool.submit(req);
+			break;
+		}
+	}
+
+	//ecm.dump();
+
+	return 0;
+}
+
+inline int descramble_ts(context& c, packet_ts& ts)
+{
+	if (ts.is_error())
+		return 0;
+	if ((ts.transport_scrambling_control & 2) == 0)
+		return 0;
+
+	//Never wait for keys, packets without keys are held before
+	descrambler_ts& d = c.descrambler[ts.pid];
+
+	c.last_tsc[ts.pid] = ts.transport_scrambling_control;
+
+	d.descramble(ts);
+	if (!c.ns_first_clear && ts.transport_scrambling_control == 0)
+		c.set_first_clear();
+
+	return 0;
+}
+
+/**
+ * Check the keys of the packet are not ready yet.
+ */
+inline bool is_key_needed(context& c, const packet_ts& ts)
+{
+	if (ts.is_error())
+		return false;
+	if ((ts.transport_scrambling_control & 2) == 0)
+		return false;
+
+	uint32_t pid_ecm = c.es_ecm[ts.pid];
+	descrambler_ts& d = c.descrambler[ts.pid];
+
+	if (!c.pool.is_available())
+		return false;
+	//PMT is not received yet at start up, ES may be mapped later
+	if (pid_ecm == 0x1fff)
+		return !c.psi_ready;
+
+	bool valid_key = (ts.transport_scrambling_control == 3) ?
+		d.is_valid_odd() : d.is_valid_even();
+
+	//Keys of the new parity may be in the pending ECM
+	if (!c.ecm_pending[pid_ecm].empty())
+		return !valid_key ||
+			ts.transport_scrambling_control != c.last_tsc[ts.pid];
+
+	//ECM is not arrived yet
+	return !valid_key;
+}
+
+/**
+ * Descramble held packets from the head by current keys, and move
+ * them to buf_released.
+ *
+ * @h   held packets of a PID
+ * @len size of packets to release, multiple of TS packet size
+ */
+inline void release_ts_packets(context& c, hold_ts& h, size_t len)
+{
+	std::vector<char>& buf = h.buf;
+
+	for (size_t pos = 0; pos < len; pos += SIZE_TS) {
+		bitstream<char *> bs(&buf[pos], 0, SIZE_TS);
+		packet_ts ts;
+		ts.set_light_mode(true);
+
+		ts.peek(bs);
+		descramble_ts(c, ts);
+		ts.poke(bs);
+	}
+	c.buf_released.insert(c.buf_released.end(), buf.begin(),
+		buf.begin() + len);
+	buf.erase(buf.begin(), buf.begin() + len);
+}
+
+/**
+ * Hold the packet if the keys are not ready, or other packets of the
+ * PID are held to keep the order.
+ *
+ * @return true if the packet is held
+ */
+inline bool hold_ts_packet(context& c, const packet_ts& ts, const char *pkt)
+{
+	auto it = c.holds.find(ts.pid);
+
+	if (it == c.holds.end()) {
+		if (!is_key_needed(c, ts))
+			return false;
+
+		it = c.holds.insert(std::make_pair(ts.pid, hold_ts())).first;
+		it->second.ns_limit = context::get_time_ns() +
+			(uint64_t)HOLD_TIMEOUT * 1000000;
+	}
+
+	hold_ts& h = it->second;
+
+	if (h.buf.size() >= HOLD_SIZE) {
+		//Too many packets, release the older half without keys
+		release_ts_packets(c, h, HOLD_SIZE / 2);
+		c.cnt_hold_overflow += HOLD_SIZE / 2 / SIZE_TS;
+	}
+
+	h.buf.insert(h.buf.end(), pkt, pkt + SIZE_TS);
+	c.cnt_held++;
+
+	return true;
+}
+
+/**
+ * Descramble held packets whose keys are arrived, or time is out,
+ * and move them to buf_released.
+ *
+ * @all release all packets
+ */
+inline void release_ts(context& c, bool all)
+{
+	uint64_t ns_now = context::get_time_ns();
+
+	for (auto it = c.holds.begin(); it != c.holds.end(); ) {
+		hold_ts& h = it->second;
+		std::vector<char>& buf = h.buf;
+		bitstream<char *> bs_first(&buf[0], 0, SIZE_TS);
+		packet_ts ts_first;
+		bool timeout = ns_now >= h.ns_limit;
+
+		ts_first.set_light_mode(true);
+		ts_first.peek(bs_first);
+		if (!all && !timeout && is_key_needed(c, ts_first)) {
+			++it;
+			continue;
+		}
+		if (timeout)
+			c.cnt_hold_timeout += buf.size() / SIZE_TS;
+
+		release_ts_packets(c, h, buf.size());
+		it = c.holds.erase(it);
+	}
+}
+
+/**
+ * Release all held packets at the end of input.
+ *
+ * @return size of packets in buf_released
+ */
+inline size_t proc_ts_flush(context& c)
+{
+	for (auto& e : c.holds) {
+		uint32_t pid_ecm = c.es_ecm[e.first];
+
+		if (pid_ecm != 0x1fff)
+			c.wait_ecm(pid_ecm);
+	}
+	release_ts(c, true);
+
+	return c.buf_released.size();
+}
+
+/**
+ * Process and descramble TS packets in place.
+ *
+ * Packets which are not output are removed, and rest of packets are
+ * moved to the head of buf. Packets whose keys are not arrived are
+ * held, and moved to buf_released of context later. The caller must
+ * output buf_released before buf.
+ *
+ * @buf TS packets
+ * @len size of buf, multiple of TS packet size
+ * @return size of packets left in buf
+ */
+inline size_t proc_ts_chunk(context& c, char *buf, size_t len)
+{
+	service_filter& f = c.filter_service;
+	size_t out = 0;
+
+	c.poll_card();
+	release_ts(c, false);
+
+	for (size_t pos = 0; pos + SIZE_TS <= len; pos += SIZE_TS) {
+		bitstream<char *> bs(&buf[pos], 0, SIZE_TS);
+		packet_ts ts;
+		ts.set_light_mode(true);
+
+		ts.peek(bs);
+		if (ts.pid != 0x1fff) {
+			proc_ts(c, ts);
+			if (!f.is_passed(ts.pid))
+				continue;
+			if (hold_ts_packet(c, ts, &buf[pos]))
+				continue;
+
+			descramble_ts(c, ts);
+			ts.poke(bs);
+		} else if (f.is_enabled()) {
+			continue;
+		}
+
+		if (ts.pid == 0 && f.is_enabled() &&
+		    f.rewrite_pat((uint8_t *)&buf[pos]))
+			continue;
+
+		if (out != pos)
+			memmove(&buf[out], &buf[pos], SIZE_TS);
+		out += SIZE_TS;
+	}
+
+	return out;
+}
+
+#endif //CONTEXT_HPP__
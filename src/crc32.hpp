@@ -0,0 +1,50 @@
+#ifndef CRC32_HPP__
+#define CRC32_HPP__
+
+#include <cstdint>
+#include <cinttypes>
+
+/**
+ * CRC32 of PSI sections (ISO 13818-1 Annex B).
+ *
+ * Polynomial 0x04c11db7, MSB first, initial value 0xffffffff,
+ * no final xor.
+ */
+class crc32_mpeg2 {
+public:
+	static uint32_t calc(const uint8_t *buf, size_t len)
+	{
+		const uint32_t *tbl = get_table();
+		uint32_t crc = 0xffffffff;
+
+		for (size_t i = 0; i < len; i++)
+			crc = (crc << 8) ^ tbl[((crc >> 24) ^ buf[i]) & 0xff];
+
+		return crc;
+	}
+
+protected:
+	struct table {
+		table()
+		{
+			for (uint32_t i = 0; i < 256; i++) {
+				uint32_t c = i << 24;
+
+				for (int j = 0; j < 8; j++)
+					c = (c & 0x80000000) ? (c << 1) ^ 0x04c11db7 : (c << 1);
+				v[i] = c;
+			}
+		}
+
+		uint32_t v[256];
+	};
+
+	static const uint32_t *get_table()
+	{
+		static const table tbl;
+
+		return tbl.v;
+	}
+};
+
+#endif //CRC32_HPP__
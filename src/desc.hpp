@@ -57,6 +57,8 @@ public:
 	template <class T>
 	void write_stub(bitstream<T>& bs)
 	{
+		bs.set_bits(8, descriptor_tag   );
+		bs.set_bits(8, descriptor_length);
 	}
 
 	virtual void dump()
@@ -5,6 +5,8 @@
 #include <cstdint>
 #include <cinttypes>
 
+#include <vector>
+
 #include "desc.hpp"
 
 class desc_ca : public desc_base {
@@ -39,7 +41,9 @@ public:
 				"CA desc too small, len:%d", n);
 			return;
 		}
-		bs.skip_bits(n * 8);
+		private_data_byte.clear();
+		for (int i = 0; i < n; i++)
+			private_data_byte.push_back(bs.get_bits(8));
 	}
 
 	virtual const packet::stub_base__write& get_write_stub() const
@@ -51,6 +55,16 @@ public:
 	template <class T>
 	void write_stub(bitstream<T>& bs)
 	{
+		//4: size of ca_system_id .. ca_pid
+		descriptor_length = 4 + private_data_byte.size();
+		desc_base::write_stub(bs);
+
+		bs.set_bits(16, ca_system_id);
+		bs.set_bits( 3, 7           );
+		bs.set_bits(13, ca_pid      );
+
+		for (auto& e : private_data_byte)
+			bs.set_bits(8, e);
 	}
 
 	virtual void dump()
@@ -65,6 +79,8 @@ public:
 public:
 	uint32_t ca_system_id;
 	uint32_t ca_pid;
+
+	std::vector<uint8_t> private_data_byte;
 };
 
 #endif //DESC_HPP__
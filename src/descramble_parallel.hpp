@@ -0,0 +1,467 @@
+#ifndef DESCRAMBLE_PARALLEL_HPP__
+#define DESCRAMBLE_PARALLEL_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "context.hpp"
+#include "ecm_index.hpp"
+
+//Size of a read and write of a segment
+#define SEGMENT_BLOCK            (188 * 4096)
+
+struct segment_key {
+	segment_key() :
+		valid(false), ks_odd(0), ks_even(0)
+	{
+	}
+
+	bool valid;
+	uint64_t ks_odd;
+	uint64_t ks_even;
+};
+
+/**
+ * Keys of all ECMs of the index.
+ *
+ * Each distinct ECM is sent to the cards once, and all requests are
+ * queued at once, so two or more cards answer them in parallel.
+ */
+class segment_keys {
+public:
+	segment_keys() :
+		valid_int(false), init_vector(0), cnt_valid(0)
+	{
+		memset(system_key, 0, sizeof(system_key));
+	}
+
+	/**
+	 * Get keys of all ECMs.
+	 *
+	 * @return 0 if success, -ENODEV if no cards, -ETIMEDOUT if
+	 *         cards stop answering
+	 */
+	int lookup(card_reader_base& scrd, const ecm_index& idx)
+	{
+		const std::vector<std::vector<uint8_t>>& bodies = idx.get_bodies();
+		uint64_t ns_limit = context::get_time_ns() +
+			(uint64_t)ECM_TIMEOUT * 1000000;
+		size_t left = bodies.size();
+		card_pool pool;
+		card_response rs;
+		int ret = 0;
+
+		keys.assign(bodies.size(), segment_key());
+		cnt_valid = 0;
+
+		ret = pool.start(scrd);
+		if (ret) {
+			fprintf(stderr, "Cannot get smart card.\n");
+			return ret;
+		}
+
+		for (size_t i = 0; i < bodies.size(); i++) {
+			card_request req;
+
+			req.tag = i;
+			req.set_ecm(bodies[i].data(), bodies[i].size());
+			req.ns_submit = context::get_time_ns();
+			pool.submit(req);
+		}
+
+		while (left > 0 || !valid_int) {
+			if (!pool.wait(rs, 100)) {
+				if (!pool.is_available()) {
+					ret = -ENODEV;
+					break;
+				}
+				if (context::get_time_ns() > ns_limit) {
+					ret = -ETIMEDOUT;
+					break;
+				}
+				continue;
+			}
+			//Timeout is counted from the last response
+			ns_limit = context::get_time_ns() +
+				(uint64_t)ECM_TIMEOUT * 1000000;
+
+			if (rs.type == CARD_REQ_INT) {
+				apply_int(rs);
+			} else if (rs.tag < keys.size()) {
+				apply_ecm(rs);
+				left--;
+			}
+		}
+
+		pool.stop();
+
+		if (ret)
+			fprintf(stderr, "Keys of %zu ECMs are not answered.\n",
+				left);
+
+		return valid_int ? ret : -ENODEV;
+	}
+
+	bool is_valid() const
+	{
+		return valid_int;
+	}
+
+	const segment_key& get_key(size_t body) const
+	{
+		return keys[body];
+	}
+
+	size_t get_valid_keys() const
+	{
+		return cnt_valid;
+	}
+
+	/**
+	 * Initialize the descrambler by the system key of the card.
+	 */
+	void init_descrambler(descrambler_ts& d) const
+	{
+		uint8_t k[SYSTEM_KEY_SIZE];
+
+		memcpy(k, system_key, SYSTEM_KEY_SIZE);
+		d.set_system_key(k);
+		d.set_init_vector(init_vector);
+	}
+
+protected:
+	void apply_int(card_response& rs)
+	{
+		if (rs.ret || rs.res.size() == 0)
+			return;
+
+		bitstream<std::vector<uint8_t>::iterator> bs(rs.res.begin(), 0, rs.res.size());
+		cardres_int crint;
+
+		crint.read(bs);
+		memcpy(system_key, crint.descrambling_system_key, SYSTEM_KEY_SIZE);
+		init_vector = crint.descrambler_cbc_initial_value;
+		valid_int = true;
+	}
+
+	void apply_ecm(card_response& rs)
+	{
+		cardres_ecm res_ecm;
+		segment_key& k = keys[rs.tag];
+
+		if (rs.ret || res_ecm.read_fixed(rs.res.data(), rs.res.size()))
+			return;
+		if (!res_ecm.is_success())
+			return;
+
+		k.valid = true;
+		k.ks_odd = res_ecm.ks_odd;
+		k.ks_even = res_ecm.ks_even;
+		cnt_valid++;
+	}
+
+private:
+	bool valid_int;
+	uint8_t system_key[SYSTEM_KEY_SIZE];
+	uint64_t init_vector;
+	std::vector<segment_key> keys;
+	size_t cnt_valid;
+};
+
+/**
+ * Descramble a segment of the file independently of other segments.
+ *
+ * State of PAT, PMT and ECM at the start of the segment is restored
+ * from the index, so ES of removed programs are not descrambled by
+ * stale ECM. Both keys are taken from the last ECM, it has the keys of
+ * current and next parity. Packets before the first PMT or ECM of a
+ * PID use the first one, so the head of the file is also descrambled.
+ */
+class segment_descrambler {
+public:
+	segment_descrambler(const ecm_index& i, const segment_keys& k) :
+		idx(i), keys(k), next(0)
+	{
+		for (int j = 0; j < 0x2000; j++)
+			es_ecm[j] = 0x1fff;
+	}
+
+	/**
+	 * Restore the state at the offset.
+	 *
+	 * @off offset of the first packet of the segment
+	 */
+	void seek(uint64_t off)
+	{
+		const std::vector<ecm_index_entry>& entries = idx.get_entries();
+		std::map<uint32_t, bool> seen;
+
+		for (size_t j = 0; j < entries.size(); j++) {
+			const ecm_index_entry& e = entries[j];
+
+			if (e.type != ECM_INDEX_PMT && e.type != ECM_INDEX_ECM)
+				continue;
+			if (!seen.insert(std::make_pair(e.pid, true)).second)
+				continue;
+			apply(j);
+		}
+
+		for (next = 0; next < entries.size(); next++) {
+			if (entries[next].offset >= off)
+				break;
+			apply(next);
+		}
+	}
+
+	/**
+	 * Descramble packets in place.
+	 *
+	 * @buf TS packets
+	 * @len size of buf, multiple of TS packet size
+	 * @off offset of buf in the file
+	 */
+	void proc(char *buf, size_t len, uint64_t off)
+	{
+		const std::vector<ecm_index_entry>& entries = idx.get_entries();
+
+		for (size_t pos = 0; pos + SIZE_TS <= len; pos += SIZE_TS) {
+			while (next < entries.size() &&
+			    entries[next].offset <= off + pos) {
+				apply(next);
+				next++;
+			}
+
+			uint32_t pid = ((buf[pos + 1] & 0x1f) << 8) |
+				(uint8_t)buf[pos + 2];
+			uint32_t pid_ecm = es_ecm[pid];
+
+			if (pid_ecm == 0x1fff || !(buf[pos + 3] & 0x80))
+				continue;
+
+			bitstream<char *> bs(&buf[pos], 0, SIZE_TS);
+			packet_ts ts;
+			ts.set_light_mode(true);
+
+			ts.peek(bs);
+			if (ts.is_error())
+				continue;
+			descramblers[pid_ecm].descramble(ts);
+			ts.poke(bs);
+		}
+	}
+
+protected:
+	void apply(size_t j)
+	{
+		const ecm_index_entry& e = idx.get_entries()[j];
+
+		switch (e.type) {
+		case ECM_INDEX_PAT:
+			apply_pat(e);
+			break;
+		case ECM_INDEX_PMT:
+			apply_pmt(e);
+			break;
+		case ECM_INDEX_ECM:
+			apply_ecm(e);
+			break;
+		}
+	}
+
+	void apply_pat(const ecm_index_entry& e)
+	{
+		for (auto it = pmts.begin(); it != pmts.end(); ) {
+			if (std::find(e.pmts.begin(), e.pmts.end(), it->first) !=
+			    e.pmts.end()) {
+				++it;
+				continue;
+			}
+
+			//Program is removed
+			remove_es(it->second);
+			it = pmts.erase(it);
+		}
+	}
+
+	void apply_pmt(const ecm_index_entry& e)
+	{
+		auto it = pmts.find(e.pid);
+
+		if (it != pmts.end())
+			remove_es(it->second);
+		pmts[e.pid] = &e - &idx.get_entries()[0];
+
+		for (auto& es : e.es)
+			es_ecm[es.pid] = es.pid_ecm;
+	}
+
+	void remove_es(size_t j)
+	{
+		for (auto& es : idx.get_entries()[j].es)
+			es_ecm[es.pid] = 0x1fff;
+	}
+
+	void apply_ecm(const ecm_index_entry& e)
+	{
+		const segment_key& k = keys.get_key(e.body);
+		bool found = descramblers.count(e.pid) != 0;
+		descrambler_ts& d = descramblers[e.pid];
+
+		if (!found)
+			keys.init_descrambler(d);
+
+		//Keep previous keys if the card could not answer
+		if (!k.valid)
+			return;
+		d.set_data_key_odd(k.ks_odd);
+		d.set_data_key_even(k.ks_even);
+	}
+
+private:
+	const ecm_index& idx;
+	const segment_keys& keys;
+	size_t next;
+	//ES PID -> ECM PID
+	uint32_t es_ecm[0x2000];
+	//PMT PID -> index of the last entry
+	std::map<uint32_t, size_t> pmts;
+	//ECM PID -> descrambler
+	std::map<uint32_t, descrambler_ts> descramblers;
+};
+
+/**
+ * Descramble a recorded file by segments in parallel.
+ *
+ * The file is scanned once to build the index of ECMs, keys of all
+ * ECMs are got from the cards, and then the file is cut into segments
+ * which are descrambled by threads. The output has same size and
+ * layout as the input.
+ *
+ * @name_in  input file name, must be a regular file
+ * @name_out output file name
+ * @scrd     reader of the cards
+ * @jobs     number of threads
+ */
+inline int descramble_file_parallel(const char *name_in, const char *name_out,
+	card_reader_base& scrd, int jobs)
+{
+	std::unique_ptr<ecm_index> idx(new ecm_index);
+	segment_keys keys;
+	std::vector<char> buf(SEGMENT_BLOCK);
+	std::vector<std::thread> ths;
+	std::atomic<int> err(0);
+	uint64_t ns_st, ns_scan, ns_card, ns_end, size;
+	struct stat st;
+	int fd_in, fd_out, ret;
+	ssize_t n;
+
+	fd_in = open(name_in, O_RDONLY);
+	if (fd_in == -1) {
+		perror("open(in)");
+		fprintf(stderr, "Failed to open '%s'\n", name_in);
+		return -errno;
+	}
+	if (fstat(fd_in, &st) == -1 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "Input '%s' is not a regular file\n", name_in);
+		close(fd_in);
+		return -EINVAL;
+	}
+	size = st.st_size - st.st_size % SIZE_TS;
+
+	//Scan
+	ns_st = context::get_time_ns();
+	posix_fadvise(fd_in, 0, 0, POSIX_FADV_SEQUENTIAL);
+	while ((n = read(fd_in, &buf[0], buf.size())) > 0)
+		idx->scan(&buf[0], n - n % SIZE_TS);
+	if (n == -1) {
+		perror("read(in)");
+		close(fd_in);
+		return -errno;
+	}
+	ns_scan = context::get_time_ns();
+	idx->dump(stdout);
+
+	//Keys of all ECMs
+	ret = keys.lookup(scrd, *idx);
+	if (!keys.is_valid()) {
+		close(fd_in);
+		return ret;
+	}
+	ns_card = context::get_time_ns();
+	printf("keys: %zu of %zu ECMs\n", keys.get_valid_keys(),
+		idx->get_bodies().size());
+
+	fd_out = open(name_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd_out == -1) {
+		perror("open(out)");
+		fprintf(stderr, "Failed to open '%s'\n", name_out);
+		close(fd_in);
+		return -errno;
+	}
+	if (ftruncate(fd_out, size) == -1)
+		perror("ftruncate(out)");
+
+	if (jobs < 1)
+		jobs = 1;
+	for (int j = 0; j < jobs; j++) {
+		uint64_t st_seg = size / SIZE_TS * j / jobs * SIZE_TS;
+		uint64_t end_seg = size / SIZE_TS * (j + 1) / jobs * SIZE_TS;
+
+		ths.push_back(std::thread([&, st_seg, end_seg] {
+			segment_descrambler seg(*idx, keys);
+			std::vector<char> b(SEGMENT_BLOCK);
+
+			seg.seek(st_seg);
+			for (uint64_t off = st_seg; off < end_seg && !err; ) {
+				size_t len = std::min((uint64_t)b.size(), end_seg - off);
+				ssize_t r = pread(fd_in, &b[0], len, off);
+
+				if (r <= 0) {
+					perror("pread(in)");
+					err = -EIO;
+					break;
+				}
+				r -= r % SIZE_TS;
+				seg.proc(&b[0], r, off);
+				if (pwrite(fd_out, &b[0], r, off) != r) {
+					perror("pwrite(out)");
+					err = -EIO;
+					break;
+				}
+				off += r;
+			}
+		}));
+	}
+	for (auto& t : ths)
+		t.join();
+	ns_end = context::get_time_ns();
+
+	printf("parallel: %d segments, scan %.3f sec, card %.3f sec, "
+		"descramble %.3f sec, %.2f MB/s\n", jobs,
+		(double)(ns_scan - ns_st) / 1000000000,
+		(double)(ns_card - ns_scan) / 1000000000,
+		(double)(ns_end - ns_card) / 1000000000,
+		(double)size / 1024 / 1024 * 1000000000 / (ns_end - ns_st));
+
+	close(fd_out);
+	close(fd_in);
+
+	return err;
+}
+
+#endif //DESCRAMBLE_PARALLEL_HPP__
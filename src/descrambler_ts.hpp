@@ -4,9 +4,11 @@
 #include <cerrno>
 #include <cstdint>
 #include <cinttypes>
+#include <cstring>
 
 #include <string>
 
+#include "packet_ts.hpp"
 #include "multi2.hpp"
 #include "multi2_sse2.hpp"
 #include "multi2_neon.hpp"
@@ -19,14 +21,15 @@
 #  define multi2_fast multi2
 #endif
 
-class descrambler_ts {
+template <class M>
+class basic_descrambler_ts {
 public:
-	descrambler_ts() :
+	basic_descrambler_ts() :
 		valid_odd(0), valid_even(0)
 	{
 	}
 
-	virtual ~descrambler_ts()
+	virtual ~basic_descrambler_ts()
 	{
 	}
 
@@ -204,6 +207,61 @@ public:
 		ts.transport_scrambling_control = 0;
 	}
 
+	/**
+	 * Scramble the payload, reverse of descramble().
+	 *
+	 * Used to make synthetic streams, the key of parity must be valid.
+	 *
+	 * @ts  TS packet which is not scrambled
+	 * @tsc 3: use odd key, 2: use even key
+	 */
+	void scramble(packet_ts& ts, uint32_t tsc)
+	{
+		uint8_t work_reg[DATA_BLK_SIZE];
+		uint8_t work_out[DATA_BLK_SIZE];
+		uint8_t key[ALL_KEY_SIZE];
+		uint8_t *pay = ts.get_payload();
+		size_t pos, len;
+
+		if (tsc == 3 && is_valid_odd())
+			memcpy(key, data_key_odd, DATA_KEY_SIZE);
+		else if (tsc == 2 && is_valid_even())
+			memcpy(key, data_key_even, DATA_KEY_SIZE);
+		else
+			return;
+
+		memcpy(key + DATA_KEY_SIZE, system_key, SYSTEM_KEY_SIZE);
+
+		enc.init(0, key, ALL_KEY_SIZE);
+
+		memcpy(work_reg, init_vector, DATA_BLK_SIZE);
+
+		pos = 0;
+		len = ts.payload_len;
+
+		//CBC mode
+		while (len >= DATA_BLK_SIZE) {
+			for (int i = 0; i < DATA_BLK_SIZE; i++)
+				work_reg[i] ^= pay[pos + i];
+
+			enc.update(work_reg, 0, &pay[pos], 0);
+			memcpy(work_reg, &pay[pos], DATA_BLK_SIZE);
+
+			pos += DATA_BLK_SIZE;
+			len -= DATA_BLK_SIZE;
+		}
+
+		//OFB mode
+		while (len > 0) {
+			enc.update(work_reg, 0, work_out, 0);
+
+			for (int i = 0; len > 0; i++, pos++, len--)
+				pay[pos] ^= work_out[i];
+		}
+
+		ts.transport_scrambling_control = tsc;
+	}
+
 private:
 	int valid_odd;
 	int valid_even;
@@ -212,8 +270,10 @@ private:
 	uint8_t data_key_even[DATA_KEY_SIZE];
 	uint8_t init_vector[8];
 
-	multi2_fast dec;
-	multi2_fast enc;
+	M dec;
+	M enc;
 };
 
+typedef basic_descrambler_ts<multi2_fast> descrambler_ts;
+
 #endif //DESCRAMBLER_TS_HPP__
@@ -0,0 +1,204 @@
+#ifndef ECM_CACHE_HPP__
+#define ECM_CACHE_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cinttypes>
+
+#include <list>
+#include <vector>
+
+#include "cardres_ecm.hpp"
+
+//Max number of cached ECMs
+#define ECM_CACHE_SIZE           64
+//Lifetime of cached keys in msec
+#define ECM_CACHE_LIFETIME       60000
+
+enum ecm_cache_result {
+	ECM_CACHE_MISS,
+	ECM_CACHE_PENDING,
+	ECM_CACHE_HIT,
+};
+
+struct ecm_cache_waiter {
+	uint32_t pid;
+	uint64_t ns_submit;
+};
+
+/**
+ * LRU cache of card responses, keyed by the body of ECM section.
+ *
+ * Same ECM body is sent to the card only once. The ECM which is
+ * waiting the response of card is kept as pending entry, and other
+ * PIDs which have same ECM are registered as waiters of the entry.
+ * Nothing is persisted, the cache lives in the process.
+ */
+class ecm_cache {
+public:
+	ecm_cache() :
+		next_id(1), cnt_hit(0), cnt_pending(0), cnt_miss(0)
+	{
+	}
+
+	virtual ~ecm_cache()
+	{
+	}
+
+	/**
+	 * Find the response of ECM.
+	 *
+	 * @body     body of ECM section
+	 * @pid      PID of ECM
+	 * @ns_now   current time
+	 * @ns_limit deadline of the card if the entry is created
+	 * @res      response of card if found
+	 * @id       ID of pending entry if not found, caller must send
+	 *           the ECM to the card and call complete() by this ID
+	 * @return ECM_CACHE_HIT, ECM_CACHE_PENDING or ECM_CACHE_MISS
+	 */
+	int lookup(const std::vector<uint8_t>& body, uint32_t pid,
+		uint64_t ns_now, uint64_t ns_limit,
+		cardres_ecm& res, uint64_t& id)
+	{
+		uint64_t h = calc_hash(body);
+		ecm_cache_waiter wt = {pid, ns_now};
+		std::vector<ecm_cache_waiter> waiters;
+
+		for (auto it = entries.begin(); it != entries.end(); ++it) {
+			if (it->hash != h || it->body != body)
+				continue;
+
+			if (!it->pending && ns_now < it->ns_expire) {
+				//move to head as recently used
+				entries.splice(entries.begin(), entries, it);
+				res = it->res;
+				cnt_hit++;
+				return ECM_CACHE_HIT;
+			}
+			if (it->pending && ns_now < it->ns_expire) {
+				it->waiters.push_back(wt);
+				cnt_pending++;
+				return ECM_CACHE_PENDING;
+			}
+
+			//expired, or card did not answer in time,
+			//waiters are taken over by new entry
+			waiters = it->waiters;
+			entries.erase(it);
+			break;
+		}
+
+		entry e;
+
+		e.id = next_id++;
+		e.hash = h;
+		e.body = body;
+		e.pending = true;
+		e.ns_expire = ns_limit;
+		e.waiters = waiters;
+		e.waiters.push_back(wt);
+		entries.push_front(e);
+		evict();
+
+		id = e.id;
+		cnt_miss++;
+
+		return ECM_CACHE_MISS;
+	}
+
+	/**
+	 * Store the response of card to the pending entry.
+	 *
+	 * @id      ID of entry given by lookup()
+	 * @valid   true if the card answered, otherwise entry is removed
+	 * @res     response of card
+	 * @ns_now  current time
+	 * @waiters PIDs which wait the response
+	 * @return 0 if success, -ENOENT if entry is already removed, the
+	 *         answer must be ignored because waiters are taken over
+	 *         by the new entry
+	 */
+	int complete(uint64_t id, bool valid, const cardres_ecm& res,
+		uint64_t ns_now, std::vector<ecm_cache_waiter>& waiters)
+	{
+		for (auto it = entries.begin(); it != entries.end(); ++it) {
+			if (it->id != id || !it->pending)
+				continue;
+
+			waiters = it->waiters;
+			if (!valid) {
+				entries.erase(it);
+				return 0;
+			}
+
+			it->pending = false;
+			it->res = res;
+			it->ns_expire = ns_now + (uint64_t)ECM_CACHE_LIFETIME * 1000000;
+			it->waiters.clear();
+
+			return 0;
+		}
+
+		return -ENOENT;
+	}
+
+	void clear()
+	{
+		entries.clear();
+	}
+
+	size_t size() const
+	{
+		return entries.size();
+	}
+
+	/**
+	 * FNV-1a hash.
+	 */
+	static uint64_t calc_hash(const std::vector<uint8_t>& body)
+	{
+		uint64_t h = 0xcbf29ce484222325ULL;
+
+		for (auto b : body) {
+			h ^= b;
+			h *= 0x100000001b3ULL;
+		}
+
+		return h;
+	}
+
+protected:
+	void evict()
+	{
+		auto it = entries.end();
+
+		//Drop least recently used, keep pending entries
+		while (entries.size() > ECM_CACHE_SIZE && it != entries.begin()) {
+			--it;
+			if (!it->pending)
+				it = entries.erase(it);
+		}
+	}
+
+private:
+	struct entry {
+		uint64_t id;
+		uint64_t hash;
+		std::vector<uint8_t> body;
+		bool pending;
+		uint64_t ns_expire;
+		cardres_ecm res;
+		std::vector<ecm_cache_waiter> waiters;
+	};
+
+	std::list<entry> entries;
+	uint64_t next_id;
+
+public:
+	uint64_t cnt_hit;
+	uint64_t cnt_pending;
+	uint64_t cnt_miss;
+};
+
+#endif //ECM_CACHE_HPP__
@@ -0,0 +1,326 @@
+#ifndef ECM_INDEX_HPP__
+#define ECM_INDEX_HPP__
+
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "packet_ts.hpp"
+#include "psi_pat.hpp"
+#include "psi_pmt.hpp"
+#include "psi_ecm.hpp"
+#include "desc_ca.hpp"
+
+enum ecm_index_type {
+	ECM_INDEX_PAT,
+	ECM_INDEX_PMT,
+	ECM_INDEX_ECM,
+};
+
+/**
+ * ES of PMT.
+ */
+struct ecm_index_es {
+	uint32_t pid;
+	uint32_t pid_ecm;
+	uint32_t stream_type;
+};
+
+/**
+ * Change of PSI or ECM of a PID found by the scan.
+ */
+struct ecm_index_entry {
+	ecm_index_entry() :
+		offset(0), type(ECM_INDEX_PAT), pid(0x1fff), version(-1),
+		body(0), program(0), pid_pcr(0x1fff)
+	{
+	}
+
+	//Offset of the packet, the change is applied before this packet
+	uint64_t offset;
+	int type;
+	uint32_t pid;
+	int version;
+	//PMT PIDs of ECM_INDEX_PAT
+	std::vector<uint32_t> pmts;
+	//Index of ECM body of ECM_INDEX_ECM
+	size_t body;
+	//program_number, PCR PID and ES of ECM_INDEX_PMT
+	uint32_t program;
+	uint32_t pid_pcr;
+	std::vector<ecm_index_es> es;
+};
+
+/**
+ * Index of PAT, PMT and ECM sections of a file.
+ *
+ * Only PSI and ECM PIDs are reassembled, and only the TS header is
+ * read for other PIDs, so the scan is much faster than descrambling.
+ * Same ECM bodies are stored once. Parity switches are not indexed,
+ * an ECM has the keys of both parities, so the keys at any offset are
+ * the keys of the last ECM.
+ *
+ * PMTs which are removed from PAT are not scanned any more, and are
+ * indexed again if they are added back.
+ *
+ * Sections are indexed at the offset where the pipeline processes
+ * them, at the start of the next section of the PID.
+ */
+class ecm_index {
+public:
+	ecm_index() :
+		off_scan(0)
+	{
+		for (int i = 0; i < 0x2000; i++) {
+			types[i] = -1;
+			versions[i] = -1;
+		}
+		types[0] = ECM_INDEX_PAT;
+	}
+
+	/**
+	 * Scan packets, call in order of the file.
+	 *
+	 * @buf TS packets
+	 * @len size of buf, multiple of TS packet size
+	 */
+	void scan(const char *buf, size_t len)
+	{
+		for (size_t pos = 0; pos + 188 <= len; pos += 188, off_scan += 188) {
+			const uint8_t *p = (const uint8_t *)&buf[pos];
+			uint32_t pid = ((p[1] & 0x1f) << 8) | p[2];
+
+			if (p[0] != 0x47 || (p[1] & 0x80))
+				continue;
+
+			if (types[pid] != -1)
+				scan_section(&buf[pos], pid);
+		}
+	}
+
+	/**
+	 * Set offset of the next packet to scan, if the scan does not
+	 * start from the head of the file.
+	 */
+	void set_offset(uint64_t off)
+	{
+		off_scan = off;
+	}
+
+	/**
+	 * Check PAT, all PMTs of PAT and all ECMs of PMTs are found.
+	 */
+	bool is_complete() const
+	{
+		if (versions[0] == (uint32_t)-1)
+			return false;
+
+		for (int i = 0; i < 0x2000; i++) {
+			if ((types[i] == ECM_INDEX_PMT || types[i] == ECM_INDEX_ECM) &&
+			    versions[i] == (uint32_t)-1)
+				return false;
+		}
+
+		return true;
+	}
+
+	const std::vector<ecm_index_entry>& get_entries() const
+	{
+		return entries;
+	}
+
+	const std::vector<std::vector<uint8_t>>& get_bodies() const
+	{
+		return bodies;
+	}
+
+	void dump(FILE *fp) const
+	{
+		size_t cnt[3] = {0, 0, 0};
+
+		for (auto& e : entries)
+			cnt[e.type]++;
+
+		fprintf(fp, "index: %zu PAT, %zu PMT, %zu ECM (%zu distinct), "
+			"%" PRIu64 " bytes\n",
+			cnt[ECM_INDEX_PAT], cnt[ECM_INDEX_PMT], cnt[ECM_INDEX_ECM],
+			bodies.size(), off_scan);
+	}
+
+protected:
+	void scan_section(const char *pkt, uint32_t pid)
+	{
+		//Packet is not modified by peek
+		bitstream<char *> bs(const_cast<char *>(pkt), 0, 188);
+		packet_ts ts;
+		payload_ts& pay = payloads[pid];
+
+		ts.set_light_mode(true);
+		ts.peek(bs);
+		if (ts.is_error())
+			return;
+
+		pay.add_ts(ts);
+		if (!pay.is_valid() || !ts.payload_unit_start_indicator)
+			return;
+
+		auto& buf = pay.get_payload();
+		bitstream<std::vector<uint8_t>::iterator> bsp(buf.begin(), 0, buf.size());
+
+		if (buf.size() == 0)
+			return;
+
+		switch (types[pid]) {
+		case ECM_INDEX_PAT:
+			add_pat(bsp);
+			break;
+		case ECM_INDEX_PMT:
+			add_pmt(bsp, pid);
+			break;
+		case ECM_INDEX_ECM:
+			add_ecm(bsp, pid);
+			break;
+		}
+	}
+
+	template <class T>
+	void add_pat(bitstream<T>& bs)
+	{
+		psi_pat pat;
+
+		pat.read(bs);
+		if (pat.is_error() || pat.version_number == versions[0])
+			return;
+		versions[0] = pat.version_number;
+
+		ecm_index_entry& ent = add_entry(ECM_INDEX_PAT, 0,
+			pat.version_number);
+
+		for (auto& e : pat.progs) {
+			if (e.program_number == 0)
+				continue;
+
+			ent.pmts.push_back(e.program_map_id);
+		}
+
+		//Removed PMTs
+		for (int i = 0; i < 0x2000; i++) {
+			if (types[i] != ECM_INDEX_PMT ||
+			    std::find(ent.pmts.begin(), ent.pmts.end(), i) != ent.pmts.end())
+				continue;
+
+			types[i] = -1;
+			versions[i] = -1;
+			payloads[i].reset();
+		}
+
+		for (auto pid : ent.pmts) {
+			if (types[pid] == -1)
+				types[pid] = ECM_INDEX_PMT;
+		}
+	}
+
+	template <class T>
+	void add_pmt(bitstream<T>& bs, uint32_t pid)
+	{
+		uint32_t default_ecm = 0x1fff;
+		psi_pmt pmt;
+
+		pmt.read(bs);
+		if (pmt.is_error() || pmt.version_number == versions[pid])
+			return;
+		versions[pid] = pmt.version_number;
+
+		ecm_index_entry& ent = add_entry(ECM_INDEX_PMT, pid,
+			pmt.version_number);
+
+		ent.program = pmt.program_number;
+		ent.pid_pcr = pmt.pcr_pid;
+
+		for (auto& e : pmt.descs) {
+			if (e->descriptor_tag != DESC_CA)
+				continue;
+
+			default_ecm = dynamic_cast<desc_ca&>(*e).ca_pid;
+		}
+
+		for (auto& e : pmt.esinfos) {
+			uint32_t pid_ecm = default_ecm;
+
+			for (auto& e_es : e.descs) {
+				if (e_es->descriptor_tag != DESC_CA)
+					continue;
+
+				desc_ca& dsc_es = dynamic_cast<desc_ca&>(*e_es);
+
+				if (dsc_es.ca_pid != 0x1fff)
+					pid_ecm = dsc_es.ca_pid;
+			}
+
+			ecm_index_es es = {e.elementary_pid, pid_ecm, e.stream_type};
+
+			ent.es.push_back(es);
+			if (pid_ecm == 0x1fff)
+				continue;
+			if (types[pid_ecm] == -1)
+				types[pid_ecm] = ECM_INDEX_ECM;
+		}
+	}
+
+	template <class T>
+	void add_ecm(bitstream<T>& bs, uint32_t pid)
+	{
+		psi_ecm ecm;
+
+		ecm.read(bs);
+		if (ecm.is_error() || ecm.version_number == versions[pid])
+			return;
+		if (ecm.body.size() > 255)
+			return;
+		versions[pid] = ecm.version_number;
+
+		ecm_index_entry& ent = add_entry(ECM_INDEX_ECM, pid,
+			ecm.version_number);
+		auto it = map_body.find(ecm.body);
+
+		if (it == map_body.end()) {
+			it = map_body.insert(std::make_pair(ecm.body,
+				bodies.size())).first;
+			bodies.push_back(ecm.body);
+		}
+		ent.body = it->second;
+	}
+
+	ecm_index_entry& add_entry(int type, uint32_t pid, int version)
+	{
+		entries.push_back(ecm_index_entry());
+
+		ecm_index_entry& e = entries.back();
+
+		e.offset = off_scan;
+		e.type = type;
+		e.pid = pid;
+		e.version = version;
+
+		return e;
+	}
+
+private:
+	uint64_t off_scan;
+	std::vector<ecm_index_entry> entries;
+	std::vector<std::vector<uint8_t>> bodies;
+	std::map<std::vector<uint8_t>, size_t> map_body;
+
+	//Type of PID to scan, or -1
+	int types[0x2000];
+	uint32_t versions[0x2000];
+	payload_ts payloads[0x2000];
+};
+
+#endif //ECM_INDEX_HPP__
@@ -0,0 +1,448 @@
+#ifndef EXTRACT_RANGE_HPP__
+#define EXTRACT_RANGE_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "descramble_parallel.hpp"
+#include "ecm_index.hpp"
+#include "sink.hpp"
+
+//Size of a read of probing time and of a step of backward scan
+#define EXTRACT_BLOCK            (188 * 4096)
+//Max size to read forward to find PCR at the head
+#define EXTRACT_PROBE_MAX        (188 * 65536)
+//Max size to scan backward to find PAT, PMT and ECM
+#define EXTRACT_BACK_MAX         (188 * 1024 * 1024)
+//Wrap around of PCR, 2^33 * 300
+#define EXTRACT_PCR_WRAP         (0x200000000ULL * 300)
+//Offset of MJD from UNIX epoch in days
+#define EXTRACT_MJD_EPOCH        40587
+
+enum extract_type {
+	EXTRACT_BYTE,
+	EXTRACT_PCR,
+	EXTRACT_TOT,
+};
+
+/**
+ * Extract a range of a recorded file and descramble only the range.
+ *
+ * Range is given by bytes, seconds of PCR from the head of the file,
+ * or JST of TOT. Time is found by binary search of the file, and then
+ * PAT, PMT and ECM before the start are found by scanning backward,
+ * so the time is proportional to the size of the range.
+ */
+class extract_range {
+public:
+	extract_range() :
+		type(EXTRACT_BYTE), start(0), end(UINT64_MAX), fd(-1), size(0),
+		pid_pcr(0x1fff), pcr_head(0)
+	{
+	}
+
+	virtual ~extract_range()
+	{
+		if (fd != -1)
+			close(fd);
+	}
+
+	/**
+	 * Parse the range.
+	 *
+	 * @arg 'start-end' in bytes, 'pcr:start-end' in seconds, or
+	 *      'tot:YYYYMMDDhhmmss-YYYYMMDDhhmmss' in JST,
+	 *      end can be omitted
+	 */
+	int parse(const char *arg)
+	{
+		const char *p = arg;
+		char *e;
+
+		if (strncmp(p, "pcr:", 4) == 0) {
+			type = EXTRACT_PCR;
+			p += 4;
+		} else if (strncmp(p, "tot:", 4) == 0) {
+			type = EXTRACT_TOT;
+			p += 4;
+		}
+
+		if (parse_value(p, &e, start))
+			goto err_out;
+		if (*e == '-' && e[1] != '\0') {
+			if (parse_value(e + 1, &e, end))
+				goto err_out;
+		}
+		if (*e != '\0' && strcmp(e, "-") != 0)
+			goto err_out;
+		if (start >= end)
+			goto err_out;
+
+		return 0;
+
+err_out:
+		fprintf(stderr, "Invalid range '%s'\n", arg);
+		return -EINVAL;
+	}
+
+	/**
+	 * Descramble the range of the input and write to the output.
+	 *
+	 * @name_in input file name, must be a regular file
+	 * @out     output
+	 * @scrd    reader of the cards
+	 */
+	int run(const char *name_in, sink_base& out, card_reader_base& scrd)
+	{
+		std::unique_ptr<ecm_index> idx;
+		segment_keys keys;
+		uint64_t off_st, off_end, off_back;
+		int ret;
+
+		fd = open(name_in, O_RDONLY);
+		if (fd == -1) {
+			perror("open(in)");
+			fprintf(stderr, "Failed to open '%s'\n", name_in);
+			return -errno;
+		}
+
+		struct stat st;
+
+		if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+			fprintf(stderr, "Input '%s' is not a regular file\n", name_in);
+			return -EINVAL;
+		}
+		size = st.st_size - st.st_size % SIZE_TS;
+
+		if (type == EXTRACT_BYTE) {
+			off_st = std::min(start - start % SIZE_TS, size);
+			off_end = std::min(end - end % SIZE_TS, size);
+		} else {
+			ret = find_pcr_pid();
+			if (ret)
+				return ret;
+			off_st = find_offset(start, false);
+			off_end = (end == UINT64_MAX) ? size : find_offset(end, true);
+		}
+		if (off_st >= off_end) {
+			fprintf(stderr, "Range is out of the file\n");
+			return -EINVAL;
+		}
+
+		ret = find_back(off_st, off_back);
+		if (ret)
+			return ret;
+
+		//Index from PSI before the start to the end
+		idx.reset(new ecm_index);
+		ret = scan_index(*idx, off_back, off_end);
+		if (ret)
+			return ret;
+		idx->dump(stdout);
+
+		keys.lookup(scrd, *idx);
+		if (!keys.is_valid())
+			return -ENODEV;
+
+		segment_descrambler seg(*idx, keys);
+		std::vector<char> buf(EXTRACT_BLOCK);
+
+		seg.seek(off_st);
+		for (uint64_t off = off_st; off < off_end; ) {
+			size_t len = std::min((uint64_t)buf.size(), off_end - off);
+			ssize_t n = pread(fd, &buf[0], len, off);
+
+			if (n <= 0) {
+				perror("pread(in)");
+				return -EIO;
+			}
+			n -= n % SIZE_TS;
+			seg.proc(&buf[0], n, off);
+			ret = out.write(&buf[0], n);
+			if (ret)
+				return ret;
+			off += n;
+		}
+
+		printf("extract: %" PRIu64 " - %" PRIu64 " (%" PRIu64 " bytes), "
+			"PSI from %" PRIu64 "\n",
+			off_st, off_end, off_end - off_st, off_back);
+
+		return 0;
+	}
+
+protected:
+	/**
+	 * Parse a position, bytes, seconds or JST.
+	 */
+	int parse_value(const char *p, char **e, uint64_t& v)
+	{
+		if (type == EXTRACT_PCR) {
+			double sec = strtod(p, e);
+
+			if (*e == p || sec < 0)
+				return -EINVAL;
+			v = (uint64_t)(sec * 27000000);
+		} else if (type == EXTRACT_TOT) {
+			unsigned int y, mo, d, h, mi, s;
+
+			if (sscanf(p, "%4u%2u%2u%2u%2u%2u", &y, &mo, &d, &h, &mi, &s) != 6)
+				return -EINVAL;
+			*e = (char *)p + 14;
+			v = to_sec(days_from_civil(y, mo, d), h, mi, s);
+		} else {
+			v = strtoull(p, e, 0);
+			if (*e == p)
+				return -EINVAL;
+		}
+
+		return 0;
+	}
+
+	/**
+	 * Find the PCR PID and the PCR at the head of the file.
+	 */
+	int find_pcr_pid()
+	{
+		uint64_t off_found;
+
+		if (type != EXTRACT_PCR)
+			return 0;
+
+		if (probe(0, std::min(size, (uint64_t)EXTRACT_PROBE_MAX),
+		    pcr_head, off_found)) {
+			fprintf(stderr, "PCR is not found\n");
+			return -EINVAL;
+		}
+
+		return 0;
+	}
+
+	/**
+	 * Binary search of the offset where the time is reached.
+	 *
+	 * Times are sparse, such as TOT. Each probe reads forward until a
+	 * time is found, and a part without times narrows the search but
+	 * is not compared with the time.
+	 *
+	 * @t     time, 27MHz from the head of file or seconds of TOT
+	 * @after return the offset after the time instead of before
+	 * @return offset of the last packet whose time is not after t,
+	 *         or of the first packet whose time is after t
+	 */
+	uint64_t find_offset(uint64_t t, bool after)
+	{
+		//Time at lo is not after t, time at hi is after t, and
+		//no times are found in [lim, hi)
+		uint64_t lo = 0, lim = size, hi = size, v, off_found;
+
+		while (lim - lo > EXTRACT_BLOCK) {
+			uint64_t mid = (lo + lim) / 2;
+
+			mid -= mid % SIZE_TS;
+			if (probe(mid, lim, v, off_found)) {
+				lim = mid;
+			} else if (v <= t) {
+				lo = off_found;
+			} else {
+				hi = off_found;
+				lim = off_found;
+			}
+		}
+
+		return after ? hi : lo;
+	}
+
+	/**
+	 * Get the first PCR or TOT after the offset.
+	 *
+	 * @off    offset to start reading
+	 * @limit  offset to stop reading
+	 * @v      time, 27MHz from the head or seconds of TOT
+	 * @off_found offset of the packet which has the time
+	 * @return 0 if success, -ENOENT if not found
+	 */
+	int probe(uint64_t off, uint64_t limit, uint64_t& v, uint64_t& off_found)
+	{
+		std::vector<char> buf(EXTRACT_BLOCK);
+
+		while (off < limit) {
+			size_t len = std::min((uint64_t)buf.size(), limit - off);
+			ssize_t n = pread(fd, &buf[0], len, off);
+
+			if (n <= 0)
+				break;
+			n -= n % SIZE_TS;
+			if (n == 0)
+				break;
+
+			for (ssize_t pos = 0; pos < n; pos += SIZE_TS) {
+				if (get_time(&buf[pos], v)) {
+					off_found = off + pos;
+					return 0;
+				}
+			}
+			off += n;
+		}
+
+		return -ENOENT;
+	}
+
+	bool get_time(const char *pkt, uint64_t& v)
+	{
+		if (type == EXTRACT_PCR)
+			return get_pcr(pkt, v);
+
+		return get_tot(pkt, v);
+	}
+
+	bool get_pcr(const char *pkt, uint64_t& v)
+	{
+		//Packet is not modified by peek
+		bitstream<char *> bs(const_cast<char *>(pkt), 0, SIZE_TS);
+		packet_ts ts;
+
+		//Check adaptation field and PCR flag before parsing
+		if (!(pkt[3] & 0x20) || (uint8_t)pkt[4] == 0 || !(pkt[5] & 0x10))
+			return false;
+
+		ts.set_light_mode(true);
+		ts.peek(bs);
+		if (ts.is_error() || !ts.adapt.pcr_flag)
+			return false;
+		if (pid_pcr == 0x1fff)
+			pid_pcr = ts.pid;
+		if (ts.pid != pid_pcr)
+			return false;
+
+		v = (ts.adapt.get_pcr() + EXTRACT_PCR_WRAP - pcr_head) %
+			EXTRACT_PCR_WRAP;
+
+		return true;
+	}
+
+	/**
+	 * Get JST of TDT or TOT, they have same layout at the head.
+	 */
+	bool get_tot(const char *pkt, uint64_t& v)
+	{
+		const uint8_t *p = (const uint8_t *)pkt;
+		uint32_t pid = ((p[1] & 0x1f) << 8) | p[2];
+		size_t pos = 4;
+
+		if (pid != 0x0014 || !(p[1] & 0x40) || (p[1] & 0x80))
+			return false;
+		if (p[3] & 0x20)
+			pos += 1 + p[4];
+		//Pointer field
+		if (pos >= SIZE_TS)
+			return false;
+		pos += 1 + p[pos];
+		if (pos + 8 > SIZE_TS || (p[pos] != 0x70 && p[pos] != 0x73))
+			return false;
+
+		const uint8_t *t = &p[pos + 3];
+		uint32_t mjd = (t[0] << 8) | t[1];
+
+		v = to_sec((int64_t)mjd - EXTRACT_MJD_EPOCH, from_bcd(t[2]),
+			from_bcd(t[3]), from_bcd(t[4]));
+
+		return true;
+	}
+
+	/**
+	 * Find the offset before the start where PAT, PMT and ECM are
+	 * found, the window is doubled until all are found.
+	 */
+	int find_back(uint64_t off_st, uint64_t& off_back)
+	{
+		for (uint64_t back = EXTRACT_BLOCK; ; back *= 2) {
+			std::unique_ptr<ecm_index> idx(new ecm_index);
+			int ret;
+
+			off_back = (off_st > back) ? off_st - back : 0;
+			ret = scan_index(*idx, off_back, off_st);
+			if (ret)
+				return ret;
+			if (idx->is_complete() || off_back == 0)
+				return 0;
+			if (back >= EXTRACT_BACK_MAX) {
+				fprintf(stderr, "PSI is not found before the start\n");
+				return 0;
+			}
+		}
+	}
+
+	int scan_index(ecm_index& idx, uint64_t off_st, uint64_t off_end)
+	{
+		std::vector<char> buf(EXTRACT_BLOCK);
+
+		idx.set_offset(off_st);
+		for (uint64_t off = off_st; off < off_end; ) {
+			size_t len = std::min((uint64_t)buf.size(), off_end - off);
+			ssize_t n = pread(fd, &buf[0], len, off);
+
+			if (n <= 0) {
+				perror("pread(in)");
+				return -EIO;
+			}
+			n -= n % SIZE_TS;
+			idx.scan(&buf[0], n);
+			off += n;
+		}
+
+		return 0;
+	}
+
+	static unsigned int from_bcd(uint8_t b)
+	{
+		return (b >> 4) * 10 + (b & 0x0f);
+	}
+
+	static uint64_t to_sec(int64_t days, unsigned int h, unsigned int m,
+		unsigned int s)
+	{
+		return (uint64_t)(days + EXTRACT_MJD_EPOCH) * 86400 +
+			h * 3600 + m * 60 + s;
+	}
+
+	/**
+	 * Days from 1970-01-01 of the date.
+	 */
+	static int64_t days_from_civil(int64_t y, unsigned int m, unsigned int d)
+	{
+		y -= m <= 2;
+
+		int64_t era = (y >= 0 ? y : y - 399) / 400;
+		unsigned int yoe = (unsigned int)(y - era * 400);
+		unsigned int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+		unsigned int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+		return era * 146097 + (int64_t)doe - 719468;
+	}
+
+private:
+	int type;
+	uint64_t start;
+	uint64_t end;
+
+	int fd;
+	uint64_t size;
+	uint32_t pid_pcr;
+	uint64_t pcr_head;
+};
+
+#endif //EXTRACT_RANGE_HPP__
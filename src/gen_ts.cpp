@@ -0,0 +1,352 @@
+#include <cstdio>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "packet_ts.hpp"
+#include "psi_pat.hpp"
+#include "psi_pmt.hpp"
+#include "psi_ecm.hpp"
+#include "card_script.hpp"
+#include "descrambler_ts.hpp"
+
+#define SIZE_TS          188
+#define SIZE_TS_CHUNK    (188 * 7)
+
+#define GEN_TSID         0x7fe0
+#define GEN_PROGRAM      0x0400
+#define GEN_PID_NIT      0x0010
+#define GEN_PID_PMT      0x01f0
+#define GEN_PID_ECM      0x0060
+#define GEN_PID_VIDEO    0x0100
+#define GEN_PID_AUDIO    0x0110
+#define GEN_PID_NULL     0x1fff
+#define GEN_CA_SYSTEM_ID 0x0005
+//Distance of PIDs of programs
+#define GEN_PID_STEP     0x0020
+
+//Interval of PSI and ECM sections in packets
+#define GEN_INTERVAL_PSI 200
+
+/**
+ * Write synthetic TS packets, scrambled by the keys of the fixture.
+ */
+class gen_ts_writer {
+public:
+	gen_ts_writer(int fd, uint32_t seed) :
+		fd_out(fd), rnd(seed)
+	{
+		memset(cc, 0, sizeof(cc));
+	}
+
+	int flush()
+	{
+		size_t pos = 0;
+
+		while (pos < buf.size()) {
+			ssize_t n = write(fd_out, &buf[pos], buf.size() - pos);
+			if (n == -1) {
+				perror("write");
+				return -1;
+			}
+			pos += n;
+		}
+		buf.clear();
+
+		return 0;
+	}
+
+	uint8_t *next_packet(uint32_t pid, uint32_t pusi, uint32_t tsc,
+		packet_ts& ts)
+	{
+		buf.resize(buf.size() + SIZE_TS);
+
+		uint8_t *pkt = &buf[buf.size() - SIZE_TS];
+		bitstream<uint8_t *> bs(pkt, 0, SIZE_TS);
+
+		ts.set_light_mode(true);
+		ts.sync_byte = 0x47;
+		ts.transport_error_indicator = 0;
+		ts.payload_unit_start_indicator = pusi;
+		ts.transport_priority = 0;
+		ts.pid = pid;
+		ts.transport_scrambling_control = tsc;
+		ts.adaptation_field_control = 1;
+		ts.continuity_counter = cc[pid];
+		ts.poke(bs);
+
+		cc[pid] = (cc[pid] + 1) & 0xf;
+
+		return pkt;
+	}
+
+	void put_section(uint32_t pid, psi_base& sect)
+	{
+		packet_ts ts;
+		uint8_t *pkt = next_packet(pid, 1, 0, ts);
+		bitstream<uint8_t *> bs(pkt, 4, SIZE_TS - 4);
+
+		memset(&pkt[4], 0xff, SIZE_TS - 4);
+		sect.write(bs);
+	}
+
+	void put_es(uint32_t pid, uint32_t pusi, uint32_t tsc,
+		descrambler_ts& scr)
+	{
+		packet_ts ts;
+		uint8_t *pkt = next_packet(pid, pusi, 0, ts);
+		bitstream<uint8_t *> bs(pkt, 0, SIZE_TS);
+
+		for (size_t i = 4; i < SIZE_TS; i++)
+			pkt[i] = rnd();
+
+		ts.peek(bs);
+		scr.scramble(ts, tsc);
+		ts.poke(bs);
+	}
+
+	/**
+	 * Put PCR by the packet of adaptation field only.
+	 */
+	void put_pcr(uint32_t pid, uint64_t pcr)
+	{
+		packet_ts ts;
+		uint32_t cc_prev = (cc[pid] - 1) & 0xf;
+		uint8_t *pkt = next_packet(pid, 0, 0, ts);
+		uint64_t base = pcr / 300, ext = pcr % 300;
+
+		//continuity_counter is not incremented without payload
+		pkt[3] = 0x20 | cc_prev;
+		cc[pid] = (cc_prev + 1) & 0xf;
+
+		memset(&pkt[4], 0xff, SIZE_TS - 4);
+		pkt[4] = SIZE_TS - 5;
+		pkt[5] = 0x10;
+		pkt[6] = base >> 25;
+		pkt[7] = base >> 17;
+		pkt[8] = base >> 9;
+		pkt[9] = base >> 1;
+		pkt[10] = ((base & 1) << 7) | 0x7e | (ext >> 8);
+		pkt[11] = ext;
+	}
+
+	void put_null()
+	{
+		packet_ts ts;
+		uint8_t *pkt = next_packet(GEN_PID_NULL, 0, 0, ts);
+
+		memset(&pkt[4], 0xff, SIZE_TS - 4);
+	}
+
+private:
+	int fd_out;
+	std::mt19937 rnd;
+	uint32_t cc[0x2000];
+	std::vector<uint8_t> buf;
+};
+
+void usage(int argc, char *argv[])
+{
+	fprintf(stderr, "usage: %s -f fixture [-n packets] [-k packets] "
+			"[-c programs] [-r bitrate] [-s seed] output\n\n"
+		"  -f fixture: Synthetic keys of scripted card\n"
+		"  -n packets: Number of TS packets (default: 500000)\n"
+		"  -k packets: Packets per key period (default: 20000)\n"
+		"  -c programs: Number of programs (default: 1), program_number\n"
+		"              is 0x0400, 0x0401, ... and all share one ECM\n"
+		"  -r bitrate: Put PCR of given bits per second instead of\n"
+		"              null packets (default: 0, no PCR)\n"
+		"  -s seed   : Seed of payloads\n"
+		"  output    : Output file name, '-' means stdout\n",
+		argv[0]);
+}
+
+void make_pat(psi_pat& pat, size_t n_prog)
+{
+	pat_program nit, prg;
+
+	pat.table_id = 0x00;
+	pat.section_syntax_indicator = 1;
+	pat.transport_stream_id = GEN_TSID;
+	pat.version_number = 0;
+	pat.current_next_indicator = 1;
+
+	nit.program_number = 0;
+	nit.network_pid = GEN_PID_NIT;
+	pat.progs.push_back(nit);
+
+	for (size_t k = 0; k < n_prog; k++) {
+		prg.program_number = GEN_PROGRAM + k;
+		prg.program_map_id = GEN_PID_PMT + k;
+		pat.progs.push_back(prg);
+	}
+}
+
+void make_pmt(psi_pmt& pmt, size_t k)
+{
+	std::shared_ptr<desc_ca> ca(new desc_ca);
+	pmt_esinfo video, audio;
+
+	pmt.table_id = 0x02;
+	pmt.section_syntax_indicator = 1;
+	pmt.program_number = GEN_PROGRAM + k;
+	pmt.version_number = 0;
+	pmt.current_next_indicator = 1;
+	pmt.pcr_pid = GEN_PID_VIDEO + GEN_PID_STEP * k;
+
+	ca->descriptor_tag = DESC_CA;
+	ca->descriptor_length = 4;
+	ca->ca_system_id = GEN_CA_SYSTEM_ID;
+	ca->ca_pid = GEN_PID_ECM;
+	pmt.descs.push_back(ca);
+
+	video.stream_type = STRM_H262_VIDEO;
+	video.elementary_pid = GEN_PID_VIDEO + GEN_PID_STEP * k;
+	pmt.esinfos.push_back(video);
+
+	audio.stream_type = STRM_ISO_13818_7_AUDIO;
+	audio.elementary_pid = GEN_PID_AUDIO + GEN_PID_STEP * k;
+	pmt.esinfos.push_back(audio);
+}
+
+void make_ecm(psi_ecm& ecm, const card_script_ecm& e, uint32_t ver)
+{
+	ecm.table_id = 0x82;
+	ecm.section_syntax_indicator = 1;
+	ecm.version_number = ver & 0x1f;
+	ecm.current_next_indicator = 1;
+	ecm.body = e.body;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name_fixture = NULL, *name_out = NULL;
+	card_script_fixture fixture;
+	size_t n_pkt = 500000, n_period = 20000, n_prog = 1;
+	uint64_t bitrate = 0;
+	uint32_t seed = 1;
+	int fd_out, opt;
+	psi_pat pat;
+	std::vector<psi_pmt> pmts;
+	psi_ecm ecm;
+	static descrambler_ts scr;
+
+	while ((opt = getopt(argc, argv, "f:n:k:c:r:s:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			name_fixture = optarg;
+			break;
+		case 'n':
+			n_pkt = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			n_period = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			n_prog = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			bitrate = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argc, argv);
+			return -1;
+		}
+	}
+
+	if (!name_fixture || optind >= argc || n_period < GEN_INTERVAL_PSI ||
+	    n_prog == 0 || n_prog > 8) {
+		usage(argc, argv);
+		return -1;
+	}
+	name_out = argv[optind];
+
+	if (fixture.load(name_fixture))
+		return -1;
+
+	if (strcmp(name_out, "-") == 0) {
+		fd_out = 1;
+	} else {
+		fd_out = open(name_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd_out == -1) {
+			perror("open(out)");
+			fprintf(stderr, "Failed to open '%s'\n",
+				name_out);
+			return -1;
+		}
+	}
+
+	gen_ts_writer w(fd_out, seed);
+
+	make_pat(pat, n_prog);
+	pmts.resize(n_prog);
+	for (size_t k = 0; k < n_prog; k++)
+		make_pmt(pmts[k], k);
+	scr.set_system_key(fixture.system_key);
+	scr.set_init_vector(fixture.cbc_iv);
+
+	for (size_t i = 0; i < n_pkt; i++) {
+		size_t period = i / n_period, j = i % n_period;
+		const card_script_ecm& e = fixture.ecms[period % fixture.ecms.size()];
+		//Switch parity of the key for each period
+		uint32_t tsc = (period & 1) ? 2 : 3;
+		//Programs take turns by 8 packets
+		uint32_t step = GEN_PID_STEP * ((j / 8) % n_prog);
+
+		if (j == 0) {
+			//New ECM twice, section is processed when next
+			//section arrives
+			make_ecm(ecm, e, period);
+			scr.set_data_key_odd(e.ks_odd);
+			scr.set_data_key_even(e.ks_even);
+			w.put_section(GEN_PID_ECM, ecm);
+			w.put_section(GEN_PID_ECM, ecm);
+			i++;
+		} else if (j % GEN_INTERVAL_PSI == 0) {
+			w.put_section(0x0000, pat);
+		} else if (j % GEN_INTERVAL_PSI == 1) {
+			size_t k = (j / GEN_INTERVAL_PSI) % n_prog;
+
+			w.put_section(GEN_PID_PMT + k, pmts[k]);
+		} else if (j % GEN_INTERVAL_PSI == 2) {
+			w.put_section(GEN_PID_ECM, ecm);
+		} else if (j % 50 == 3 && bitrate) {
+			//27MHz clock at the head of this packet
+			uint64_t pcr = (uint64_t)((double)i * SIZE_TS * 8 *
+				27000000 / bitrate);
+			size_t k = (j / 50) % n_prog;
+
+			w.put_pcr(GEN_PID_VIDEO + GEN_PID_STEP * k, pcr);
+		} else if (j % 50 == 3) {
+			w.put_null();
+		} else if (j % 8 == 4) {
+			w.put_es(GEN_PID_AUDIO + step, (j % 64) == 4, tsc, scr);
+		} else {
+			w.put_es(GEN_PID_VIDEO + step, (j % 64) == 5, tsc, scr);
+		}
+
+		if ((i % 4096) == 0 && w.flush())
+			return -1;
+	}
+
+	if (w.flush())
+		return -1;
+
+	if (fd_out != 1)
+		close(fd_out);
+
+	return 0;
+}
@@ -1,3 +1,4 @@
+#include <csignal>
 #include <cstdio>
 #include <cstddef>
 #include <cstdlib>
@@ -7,484 +8,357 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <sys/socket.h>
-#include <netdb.h>
+#include <getopt.h>
 
-#include <functional>
-#include <deque>
-#include <map>
+#include <memory>
+#include <string>
 #include <vector>
 
-#include "packet_ts.hpp"
-#include "psi_pat.hpp"
-#include "psi_pmt.hpp"
-#include "psi_ecm.hpp"
+#include "context.hpp"
+#include "descramble_parallel.hpp"
+#include "extract_range.hpp"
+#include "rap_index.hpp"
+#include "sink.hpp"
+#include "sink_pace.hpp"
+#include "sink_server.hpp"
+#include "sink_shm.hpp"
 #include "smart_card.hpp"
-#include "cardres_int.hpp"
-#include "cardres_ecm.hpp"
-#include "descrambler_ts.hpp"
-
-#define SIZE_TS          188
-#define SIZE_TS_CHUNK    (188 * 7)
-
-struct context;
-typedef std::function<int(context&, payload_ts&)> func_payload;
-
-int proc_pat(context& c, payload_ts& pay);
-int proc_pmt(context& c, payload_ts& pay);
-int proc_ecm(context& c, payload_ts& pay);
-
-struct context {
-	void reset_ts_filter()
-	{
-		map_filter.clear();
-
-		map_filter.insert(std::make_pair(0, proc_pat));
-	}
-
-	void add_ts_filter(uint32_t pid, func_payload f)
-	{
-		map_filter.insert(std::make_pair(pid, f));
-	}
-
-	void remove_ts_filter(uint32_t pid)
-	{
-		map_filter.erase(pid);
-	}
-
-	void add_pmt_filters_by_pat(psi_pat& pat)
-	{
-		for (auto& e : pat.progs) {
-			if (e.program_number == 0)
-				continue;
-
-			printf("--PMT prg:%5d(0x%04x) pid:0x%04x\n",
-				e.program_number, e.program_number,
-				e.program_map_id);
-			add_pmt_filter(e.program_map_id);
-		}
-	}
-
-	void remove_pmt_filters_by_pat(psi_pat& pat)
-	{
-		for (auto& e : pat.progs) {
-			if (e.program_number == 0)
-				continue;
-
-			remove_pmt_filter(e.program_map_id);
-		}
-		pat.progs.clear();
-	}
-
-	void add_pmt_filter(uint32_t pid)
-	{
-		last_pmt[pid].version_number = -1;
-
-		add_ts_filter(pid, proc_pmt);
-	}
-
-	void remove_pmt_filter(uint32_t pid)
-	{
-		remove_ts_filter(pid);
-
-		remove_ecm_filters_by_pmt(last_pmt[pid]);
-	}
-
-	void add_ecm_filters_by_pmt(psi_pmt& pmt)
-	{
-		for (auto& e : pmt.descs) {
-			if (e->descriptor_tag != DESC_CA)
-				continue;
-
-			desc_ca& dsc = dynamic_cast<desc_ca&>(*e);
-
-			printf("  --ECM pid:0x%04x\n", dsc.ca_pid);
-			add_ecm_filter(dsc.ca_pid);
-		}
-	}
-
-	void remove_ecm_filters_by_pmt(psi_pmt& pmt)
-	{
-		for (auto& e : pmt.descs) {
-			if (e->descriptor_tag != DESC_CA)
-				continue;
-
-			desc_ca& dsc = dynamic_cast<desc_ca&>(*e);
-
-			remove_ecm_filter(dsc.ca_pid);
-		}
-		pmt.descs.clear();
-	}
-
-	void add_ecm_filter(uint32_t pid)
-	{
-		last_ecm[pid].version_number = -1;
-
-		add_ts_filter(pid, proc_ecm);
-	}
-
-	void remove_ecm_filter(uint32_t pid)
-	{
-		remove_ts_filter(pid);
-	}
-
-	void init_smartcard()
-	{
-		int ret;
-
-		if (sc.is_valid())
-			return;
-
-		valid_descrambler = 0;
-
-		ret = sc.connect(0);
-		if (ret) {
-			scrd.release();
-			scrd.establish();
-			scrd.enumerate_readers();
-			scrd.dump();
-		} else {
-			//success
-			return;
-		}
-
-		sc.set_reader(scrd);
-		ret = sc.connect(0);
-		if (ret)
-			fprintf(stderr, "Cannot get smart card.\n");
-	}
-
-	void init_descrambler()
-	{
-		if (!sc.is_valid() || valid_descrambler)
-			return;
-
-		uint8_t sc_init[] = {
-			//CLA, INS
-			0x90, 0x30,
-			//param 1, 2, length
-			0x00, 0x00, 0x00,
-		};
-		uint8_t sc_init_recv[80];
-		size_t nrecv = sizeof(sc_init_recv);
-		uint8_t *key;
-		uint64_t iv;
-
-		sc.transmit(sc_init, sizeof(sc_init), sc_init_recv, &nrecv);
-		if (nrecv == 0) {
-			fprintf(stderr, "Cannot get initialize vector.\n");
-			return;
-		}
-
-		bitstream<uint8_t *> bs(sc_init_recv, 0, nrecv);
-		cardres_int crint;
-
-		crint.read(bs);
-		key = crint.descrambling_system_key;
-		iv = crint.descrambler_cbc_initial_value;
-
-		for (int i = 0; i < 0x2000; i++) {
-			descrambler[i].set_system_key(key);
-			descrambler[i].set_init_vector(iv);
-		}
-		valid_descrambler = 1;
-
-		crint.dump();
-	}
-
-public:
-	std::map<uint32_t, func_payload> map_filter;
-	payload_ts payloads[0x2000];
-	psi_pat last_pat;
-	psi_pmt last_pmt[0x2000];
-	psi_ecm last_ecm[0x2000];
-	uint32_t es_ecm[0x2000];
-	cardres_ecm last_res_ecm[0x2000];
-
-	smart_card_reader scrd;
-	smart_card sc;
-
-	descrambler_ts descrambler[0x2000];
-	int valid_descrambler;
-};
+#include "source_replay.hpp"
+#include "source_udp.hpp"
+#include "ts_analyzer.hpp"
+#include "ts_monitor.hpp"
 
 void usage(int argc, char *argv[])
 {
-	fprintf(stderr, "usage: %s input "
+	fprintf(stderr, "usage: %s [-s] [-p program] [-o program:dest] "
+			"[-l address [-d]] [-m name] [-O] [-t] [-R rate] "
+			"[-i index] [-j jobs] [-x range] [-M sec] [-a] input "
 			"[output | address port | address port output]\n\n"
-		"  input : Input file name, '-' means stdin\n"
-		"  output: Output file name, '-' means stdout.\n"
-		"  host  : Destination address\n"
-		"  port  : Destination port\n",
+		"  -s        : Strip null packets and PIDs which are not\n"
+		"              referenced by PAT and PMT, and write by\n"
+		"              large blocks and full datagrams\n"
+		"  -p program: Output only given program_number, can be\n"
+		"              specified two or more times\n"
+		"  -o program:dest\n"
+		"            : Output given program_number to dest,\n"
+		"              dest is file name, '-' or udp://host:port.\n"
+		"              Can be specified two or more times\n"
+		"  -l address: Serve the stream to local clients,\n"
+		"              address is tcp://host:port or unix:/path\n"
+		"  -d        : Disconnect slow clients of the server,\n"
+		"              default is skipping to the latest packet\n"
+		"  -m name   : Output to shared memory ring, such as /arib\n"
+		"  -O        : Write output files by O_DIRECT\n"
+		"  -t        : Write output and address port at the rate of\n"
+		"              PCR, for playback of files\n"
+		"  -R rate   : Replay input like a tuner, rate is 'pcr' or\n"
+		"              bits per second, overflows are counted\n"
+		"  -i index  : Write random access points of the output to\n"
+		"              index file\n"
+		"  -j jobs   : Descramble a recorded file by segments in\n"
+		"              parallel, input and output must be files\n"
+		"  -x range  : Descramble only the range of a recorded file,\n"
+		"              'start-end' in bytes, 'pcr:start-end' in\n"
+		"              seconds from the head, or\n"
+		"              'tot:YYYYMMDDhhmmss-YYYYMMDDhhmmss' in JST\n"
+		"  -M sec    : Report CC errors, TEI and still scrambled\n"
+		"              packets of the output for each PID every\n"
+		"              sec seconds\n"
+		"  -a        : Analyze input without descrambling, report\n"
+		"              services, bitrates, scrambled packets, ECMs\n"
+		"              and continuity errors\n"
+		"  input     : Input file name, '-' means stdin, or\n"
+		"              udp://group:port or rtp://group:port\n"
+		"  output    : Output file name, '-' means stdout.\n"
+		"  host      : Destination address\n"
+		"  port      : Destination port\n",
 		argv[0]);
 }
 
-int proc_ts(context& c, packet_ts& ts)
-{
-	if (ts.is_error())
-		return 0;
-
-	auto it = c.map_filter.find(ts.pid);
-	if (it == c.map_filter.end())
-		return 0;
-
-	payload_ts& p = c.payloads[ts.pid];
-
-	p.add_ts(ts);
+static volatile sig_atomic_t stopping = 0;
 
-	if (!p.is_valid() || !ts.payload_unit_start_indicator)
-		return 0;
-	if (p.get_payload().size() == 0)
-		return 0;
-
-	it->second(c, p);
-
-	return 0;
-}
-
-int proc_pat(context& c, payload_ts& pay)
+void handle_stop(int sig)
 {
-	auto buf = pay.get_payload();
-	bitstream<std::vector<uint8_t>::iterator> bs(buf.begin(), 0, buf.size());
-	psi_pat& last_pat = c.last_pat;
-	psi_pat pat;
-
-	pat.read(bs);
-	if (pat.is_error()) {
-		pat.print_error(stderr);
-		return 0;
-	}
-
-	if (last_pat.version_number == pat.version_number)
-		return 0;
-
-	c.remove_pmt_filters_by_pat(last_pat);
-
-	printf("PAT ver.%2d\n", pat.version_number);
-	last_pat = pat;
-
-	c.add_pmt_filters_by_pat(pat);
-
-	//pat.dump();
-
-	return 0;
+	stopping = 1;
 }
 
-int proc_pmt(context& c, payload_ts& pay)
+ssize_t readn(int fd, void *buf, size_t count)
 {
-	auto buf = pay.get_payload();
-	packet_ts& ts = pay.get_first_ts();
-	bitstream<std::vector<uint8_t>::iterator> bs(buf.begin(), 0, buf.size());
-	psi_pmt& last_pmt = c.last_pmt[ts.pid];
-	psi_pmt pmt;
-
-	pmt.read(bs);
-	if (pmt.is_error()) {
-		pmt.print_error(stderr);
-		return 0;
-	}
-
-	if (last_pmt.version_number == pmt.version_number)
-		return 0;
-
-	c.remove_ecm_filters_by_pmt(last_pmt);
-
-	printf("  PMT ver.%2d prg:%5d(0x%04x) pid:0x%04x\n", pmt.version_number,
-		pmt.program_number, pmt.program_number, ts.pid);
-	last_pmt = pmt;
-
-	c.add_ecm_filters_by_pmt(pmt);
-
-	//Register new ES
-	uint32_t default_ecm = 0x1fff;
-
-	for (auto& e : pmt.descs) {
-		if (e->descriptor_tag != DESC_CA)
-			continue;
-
-		desc_ca& dsc = dynamic_cast<desc_ca&>(*e);
-
-		default_ecm = dsc.ca_pid;
-	}
-
-	for (auto& e : pmt.esinfos) {
-		c.es_ecm[e.elementary_pid] = 0x1fff;
-
-		if (default_ecm != 0x1fff)
-			c.es_ecm[e.elementary_pid] = default_ecm;
-
-		for (auto& e_es : e.descs) {
-			if (e_es->descriptor_tag != DESC_CA)
-				continue;
-
-			desc_ca& dsc_es = dynamic_cast<desc_ca&>(*e_es);
+	size_t nleft = count;
+	ssize_t nread;
+	char *ptr = (char *)buf;
 
-			if (dsc_es.ca_pid != 0x1fff)
-				c.es_ecm[e.elementary_pid] = dsc_es.ca_pid;
+	while (nleft > 0) {
+		nread = read(fd, ptr, nleft);
+		if (nread < 0) {
+			if (errno != EINTR)
+				return -1;
+			//Stopped by signal, return the rest
+			if (stopping)
+				break;
+			nread = 0;
+		} else if (nread == 0) {
+			//EOF
+			break;
 		}
 
-		printf("  --ES type:0x%04x pid:0x%04x ecm:0x%04x\n",
-			e.stream_type, e.elementary_pid,
-			c.es_ecm[e.elementary_pid]);
+		nleft -= nread;
+		ptr += nread;
 	}
 
-	//pmt.dump();
-
-	return 0;
+	return (count - nleft);
 }
 
-int proc_ecm(context& c, payload_ts& pay)
+int analyze_file(const char *name_in)
 {
-	auto buf = pay.get_payload();
-	packet_ts& ts = pay.get_first_ts();
-	bitstream<std::vector<uint8_t>::iterator> bs(buf.begin(), 0, buf.size());
-	psi_ecm& last_ecm = c.last_ecm[ts.pid];
-	psi_ecm ecm;
-	cardres_ecm& last_res_ecm = c.last_res_ecm[ts.pid];
-	cardres_ecm res_ecm;
-	int ret;
-
-	ecm.read(bs);
-	if (ecm.is_error()) {
-		ecm.print_error(stderr);
-		return 0;
-	}
-
-	if (last_ecm.version_number == ecm.version_number)
-		return 0;
-
-	printf("  ECM ver.%2d pid:0x%04x\n", ecm.version_number,
-		ts.pid);
-	last_ecm = ecm;
-
-	c.init_smartcard();
-	c.init_descrambler();
-
-	if (c.sc.is_valid()) {
-		size_t len_sc_ecm = ecm.body.size() + 5 + 1;
-		uint8_t sc_ecm[512] = {
-			//CLA
-			0x90,
-			//INS
-			0x34,
-			//param 1, 2
-			0x00, 0x00,
-		};
-		uint8_t sc_ecm_recv[512];
-		size_t nrecv = sizeof(sc_ecm_recv);
-
-		//cmd length, encrypted ECM
-		sc_ecm[4] = ecm.body.size();
-		for (size_t i = 0; i < ecm.body.size(); i++)
-			sc_ecm[5 + i] = ecm.body[i];
-
-		//res length
-		sc_ecm[5 + ecm.body.size()] = 0x00;
-
-		ret = c.sc.transmit(sc_ecm, len_sc_ecm, sc_ecm_recv, &nrecv);
-		//printf("body:%d, nrecv:%d\n", (int)len_sc_ecm, (int)nrecv);
-
-		if (!ret) {
-			bitstream<uint8_t *> bs_ecm(sc_ecm_recv, 0, nrecv);
-
-			res_ecm.read(bs_ecm);
+	std::unique_ptr<ts_analyzer> ana(new ts_analyzer);
+	std::vector<char> buf(ANALYZE_BLOCK);
+	ssize_t rsize;
+	int fd;
 
-			last_res_ecm = res_ecm;
-			//res_ecm.dump();
+	if (strcmp(name_in, "-") == 0) {
+		fd = 0;
+	} else {
+		fd = open(name_in, O_RDONLY);
+		if (fd == -1) {
+			perror("open(in)");
+			fprintf(stderr, "Failed to open '%s'\n", name_in);
+			return -errno;
 		}
+		//Read once from head to tail
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 	}
 
-	for (int i = 0; i < 0x2000; i++) {
-		if (c.es_ecm[i] != ts.pid)
-			continue;
-
-		c.descrambler[i].set_data_key_odd(last_res_ecm.ks_odd);
-		c.descrambler[i].set_data_key_even(last_res_ecm.ks_even);
-
-		//printf("  --ES change key pid:0x%04x ecm:0x%04x\n",
-		//	i, c.es_ecm[i]);
+	while ((rsize = readn(fd, &buf[0], buf.size())) > 0)
+		ana->scan(&buf[0], rsize);
+	if (rsize == -1) {
+		perror("read(in)");
+		fprintf(stderr, "Failed to read '%s'\n", name_in);
 	}
+	if (fd != 0)
+		close(fd);
 
-	//ecm.dump();
+	ana->report(stdout);
 
-	return 0;
+	return (rsize == -1) ? -EIO : 0;
 }
 
-int descramble_ts(context& c, packet_ts& ts)
+struct output_program {
+	service_filter filter;
+	std::shared_ptr<sink_base> sink;
+};
+
+int add_output_program(context& c, std::vector<std::shared_ptr<output_program>>& outs,
+	const char *arg, unsigned int flags)
 {
-	if (ts.is_error())
-		return 0;
-	if ((ts.transport_scrambling_control & 2) == 0)
-		return 0;
+	std::shared_ptr<output_program> o(new output_program);
+	uint32_t program_number;
+	sink_base *s;
+	char *dest;
+
+	program_number = strtoul(arg, &dest, 0);
+	if (*dest != ':' || dest[1] == '\0') {
+		fprintf(stderr, "Invalid output '%s'\n", arg);
+		return -EINVAL;
+	}
 
-	c.descrambler[ts.pid].descramble(ts);
+	s = open_sink(dest + 1, flags);
+	if (!s)
+		return -EINVAL;
+	o->sink.reset(new sink_async(s));
+
+	c.add_output_filter(&o->filter, program_number);
+	outs.push_back(o);
 
 	return 0;
 }
 
-ssize_t readn(int fd, void *buf, size_t count)
+int main(int argc, char *argv[])
 {
-	size_t nleft = count;
-	ssize_t nread;
-	char *ptr = (char *)buf;
+	std::vector<std::shared_ptr<sink_base>> sinks;
+	std::shared_ptr<sink_base> sink_srv;
+	std::shared_ptr<sink_base> sink_mem;
+	std::vector<std::shared_ptr<output_program>> outs;
+	std::vector<char> buf_out;
+	const char *name_in = NULL, *name_out = NULL;
+	const char *hostname = NULL, *servname = NULL;
+	int fd_in = -1;
+	std::unique_ptr<source_udp> src_udp;
+	std::unique_ptr<source_replay> src_replay;
+	size_t bufsize;
+	char *buf, *buf_read;
+	sink_pipe *pipe_out = NULL;
+	ssize_t rsize, wsize;
+	size_t cnt, cnt_out;
+	int i, opt, nargs, ret;
+	bool strip = false;
+	bool pace = false;
+	const char *rate_replay = NULL;
+	int jobs = 0;
+	const char *range = NULL;
+	bool analyze = false;
+	std::unique_ptr<ts_monitor> mon;
+	uint64_t ns_mon = 0, ns_report = 0;
+	rap_index rap;
+	const char *name_index = NULL;
+	const char *name_listen = NULL;
+	int policy = SINK_SERVER_SKIP;
+	const char *name_shm = NULL;
+	unsigned int flags = 0;
+	std::vector<const char *> args_out;
+	static struct context c;
 
-	while (nleft > 0) {
-		nread = read(fd, ptr, nleft);
-		if (nread < 0) {
-			if (errno == EINTR)
-				nread = 0;
-			else
+	while ((opt = getopt(argc, argv, "sp:o:l:dm:OtR:i:j:x:aM:h")) != -1) {
+		switch (opt) {
+		case 's':
+			strip = true;
+			c.filter_service.set_strip(true);
+			break;
+		case 'p':
+			c.filter_service.add_program(strtoul(optarg, NULL, 0));
+			break;
+		case 'o':
+			args_out.push_back(optarg);
+			break;
+		case 'l':
+			name_listen = optarg;
+			break;
+		case 'd':
+			policy = SINK_SERVER_DROP;
+			break;
+		case 'm':
+			name_shm = optarg;
+			break;
+		case 'O':
+			flags |= SINK_FLAG_DIRECT;
+			break;
+		case 't':
+			pace = true;
+			break;
+		case 'R':
+			rate_replay = optarg;
+			break;
+		case 'i':
+			name_index = optarg;
+			break;
+		case 'j':
+			jobs = strtol(optarg, NULL, 0);
+			break;
+		case 'x':
+			range = optarg;
+			break;
+		case 'a':
+			analyze = true;
+			break;
+		case 'M':
+			ns_mon = strtoull(optarg, NULL, 0) * 1000000000;
+			if (ns_mon == 0) {
+				fprintf(stderr, "Invalid interval '%s'\n", optarg);
 				return -1;
-		} else if (nread == 0) {
-			//EOF
+			}
 			break;
+		default:
+			usage(argc, argv);
+			return -1;
 		}
-
-		nleft -= nread;
-		ptr += nread;
 	}
 
-	return (count - nleft);
-}
+	nargs = argc - optind;
+	if (analyze) {
+		//No cards and no outputs are opened
+		if (nargs != 1 || args_out.size() > 0) {
+			usage(argc, argv);
+			return -1;
+		}
 
-int main(int argc, char *argv[])
-{
-	std::deque<char> buf_sock;
-	const char *name_in = NULL, *name_out = NULL;
-	const char *hostname = NULL, *servname = NULL;
-	int fd_in, fd_out, sock;
-	size_t bufsize;
-	char *buf;
-	struct addrinfo hints;
-	struct addrinfo *resaddr, *rp;
-	ssize_t rsize, pos;
-	size_t cnt;
-	int i, result;
-	static struct context c;
+		return analyze_file(argv[optind]) ? -1 : 0;
+	}
 
-	if (argc < 3) {
+	//Reader connects to PC/SC when constructed
+	static smart_card_reader scrd;
+
+	for (auto arg : args_out) {
+		if (add_output_program(c, outs, arg, flags))
+			return -1;
+	}
+	if (nargs < 2 && !(nargs == 1 && (outs.size() > 0 || name_listen || name_shm))) {
 		usage(argc, argv);
 		return -1;
 	}
 
-	name_in = argv[1];
-	if (argc == 3) {
+	name_in = argv[optind];
+	if (nargs == 2) {
 		hostname = NULL;
 		servname = NULL;
-		name_out = argv[2];
-	} else if (argc == 4) {
-		hostname = argv[2];
-		servname = argv[3];
+		name_out = argv[optind + 1];
+	} else if (nargs == 3) {
+		hostname = argv[optind + 1];
+		servname = argv[optind + 2];
 		name_out = NULL;
-	} else if (argc >= 5) {
-		hostname = argv[2];
-		servname = argv[3];
-		name_out = argv[4];
+	} else if (nargs >= 4) {
+		hostname = argv[optind + 1];
+		servname = argv[optind + 2];
+		name_out = argv[optind + 3];
+	}
+
+	if (jobs > 0 || range) {
+		//Output has same layout as input, no filters and sinks
+		if (nargs != 2 || outs.size() > 0 || strip ||
+		    c.filter_service.is_enabled() || name_listen ||
+		    name_shm || pace || rate_replay || (jobs > 0 && range)) {
+			fprintf(stderr, "'-j' and '-x' need only input and "
+				"output files\n");
+			return -1;
+		}
+	}
+
+	if (jobs > 0) {
+		if (strcmp(name_out, "-") == 0) {
+			fprintf(stderr, "'-j' cannot write to stdout\n");
+			return -1;
+		}
+
+		return descramble_file_parallel(name_in, name_out, scrd, jobs) ? -1 : 0;
+	}
+
+	if (range) {
+		extract_range ext;
+		std::unique_ptr<sink_base> s;
+
+		if (ext.parse(range))
+			return -1;
+		s.reset(open_sink(name_out, flags));
+		if (!s)
+			return -1;
+
+		ret = ext.run(name_in, *s, scrd);
+		s->close();
+
+		return ret ? -1 : 0;
 	}
 
 	bufsize = SIZE_TS_CHUNK;
 
-	if (strcmp(name_in, "-") == 0) {
+	if (source_udp::is_source(name_in)) {
+		src_udp.reset(new source_udp);
+		if (src_udp->open(name_in))
+			return -1;
+		//Datagrams of a recvmmsg() are processed at once
+		bufsize = SOURCE_UDP_SIZE;
+	} else if (rate_replay) {
+		uint64_t rate = 0;
+
+		if (strcmp(rate_replay, "pcr") != 0)
+			rate = strtoull(rate_replay, NULL, 0);
+		if (strcmp(rate_replay, "pcr") != 0 && rate == 0) {
+			fprintf(stderr, "Invalid rate '%s'\n", rate_replay);
+			return -1;
+		}
+
+		src_replay.reset(new source_replay);
+		if (src_replay->open(name_in, rate))
+			return -1;
+	} else if (strcmp(name_in, "-") == 0) {
 		fd_in = 0;
 	} else {
 		fd_in = open(name_in, O_RDONLY);
@@ -496,94 +370,170 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (name_out && strcmp(name_out, "-") == 0) {
-		fd_out = 1;
-	} else if (name_out) {
-		fd_out = open(name_out, O_RDWR | O_CREAT, 0644);
-		if (fd_out == -1) {
-			perror("open(out)");
-			fprintf(stderr, "Failed to open '%s'\n",
-				name_out);
+	if (hostname && servname) {
+		sink_udp *s = new sink_udp;
+
+		sinks.push_back(std::shared_ptr<sink_base>(s));
+		if (s->open(hostname, servname))
 			return -1;
-		}
-	} else {
-		fd_out = -1;
 	}
 
-	if (hostname && servname) {
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_family = AF_UNSPEC;
-		hints.ai_socktype = SOCK_DGRAM;
-		hints.ai_flags = 0;
-		hints.ai_protocol = 0;
-		result = getaddrinfo(hostname, servname, &hints, &resaddr);
-		if (result) {
-			perror("getaddrinfo");
-			fprintf(stderr, "Failed to resolve '%s:%s'\n",
-				hostname, servname);
+	if (name_out) {
+		sink_base *s = open_sink(name_out, flags);
+
+		if (!s)
+			return -1;
+		sinks.push_back(std::shared_ptr<sink_base>(s));
+	}
+
+	if (name_listen) {
+		sink_server *s = new sink_server;
+
+		//Server has own ring buffer, not batched
+		s->set_policy(policy);
+		if (s->open(name_listen)) {
+			delete s;
 			return -1;
 		}
-		rp = resaddr;
+		sink_srv.reset(s);
+	}
+
+	if (name_shm) {
+		sink_shm *s = new sink_shm;
 
-		sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-		if (sock == -1) {
-			perror("socket(INET, DGRAM)");
-			fprintf(stderr, "Failed to connect '%s:%s'\n",
-				hostname, servname);
+		//Ring of shared memory is not batched as well
+		if (s->open(name_shm)) {
+			delete s;
 			return -1;
 		}
-	} else {
-		sock = -1;
-		rp = NULL;
+		sink_mem.reset(s);
+	}
+
+	if (pace && !sinks.empty()) {
+		//Datagrams are sent one by one at the time of PCR, by one
+		//clock for all sinks
+		std::shared_ptr<sink_base> t(new sink_tee(sinks));
+		std::shared_ptr<sink_base> p(new sink_pace(t));
+
+		sinks.clear();
+		sinks.push_back(p);
 	}
 
+	if (strip) {
+		//Owner of sinks is moved to batched sinks
+		for (auto& s : sinks) {
+			std::shared_ptr<sink_base> b(new sink_batch(s, SINK_SIZE_BATCH));
+
+			s = b;
+		}
+	}
+
+	//Pipe is filled in place, if it is not wrapped by other sinks
+	if (name_out && !sinks.empty())
+		pipe_out = dynamic_cast<sink_pipe *>(sinks.back().get());
+
+	if (name_index && rap.open(name_index))
+		return -1;
+
+	if (ns_mon)
+		mon.reset(new ts_monitor);
+
 	buf = (char *)malloc(bufsize);
 	if (!buf) {
 		perror("malloc");
 		return -1;
 	}
+	buf_out.resize(bufsize);
+
+	//Close sinks to write buffered packets when stopped
+	struct sigaction sa;
 
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	c.set_card_reader(&scrd);
 	c.reset_ts_filter();
+	c.start();
+
+	auto write_ts = [&](const char *p, size_t len) {
+		if (name_index)
+			rap.write(c, p, len);
+		if (mon)
+			mon->write(p, len);
+		for (auto& s : sinks)
+			s->write(p, len);
+		if (sink_srv)
+			sink_srv->write(p, len);
+		if (sink_mem)
+			sink_mem->write(p, len);
+
+		//Released packets may be larger than a chunk
+		if (buf_out.size() < len)
+			buf_out.resize(len);
+		for (auto& o : outs) {
+			size_t n = o->filter.filter(p, len, &buf_out[0]);
+
+			o->sink->write(&buf_out[0], n);
+		}
+	};
 
 	cnt = 0;
+	cnt_out = 0;
+	if (mon)
+		ns_report = context::get_time_ns() + ns_mon;
 	i = 0;
 	printf("\n\n");
-	while (1) {
-		rsize = readn(fd_in, buf, bufsize);
-		if (rsize == -1) {
-			fprintf(stderr, "Failed to read '%s'\n",
-				name_in);
+	while (!stopping) {
+		buf_read = NULL;
+		if (pipe_out)
+			buf_read = pipe_out->get_buffer(bufsize);
+		if (!buf_read)
+			buf_read = buf;
+
+		if (src_udp)
+			rsize = src_udp->read(buf_read, bufsize);
+		else if (src_replay)
+			rsize = src_replay->read(buf_read, bufsize);
+		else
+			rsize = readn(fd_in, buf_read, bufsize);
+		if (rsize == -1 && errno == EINTR && !stopping) {
+			continue;
+		} else if (rsize == -1) {
+			if (!stopping)
+				fprintf(stderr, "Failed to read '%s'\n",
+					name_in);
 			break;
 		} else if (rsize == 0) {
 			//EOF
 			break;
 		}
 
-		for (pos = 0; pos < rsize; pos += SIZE_TS) {
-			bitstream<char *> bs(&buf[pos], 0, SIZE_TS);
-			packet_ts ts;
-			ts.set_light_mode(true);
-
-			ts.peek(bs);
-			if (ts.pid != 0x1fff) {
-				proc_ts(c, ts);
-				descramble_ts(c, ts);
-				ts.poke(bs);
-			}
+		wsize = proc_ts_chunk(c, buf_read, rsize);
+
+		//Held packets are older than this chunk
+		if (!c.buf_released.empty()) {
+			//Space of the pipe is overwritten by released packets,
+			//so the chunk is copied behind them
+			cnt_out += c.buf_released.size();
+			c.buf_released.insert(c.buf_released.end(), buf_read,
+				buf_read + wsize);
+			write_ts(&c.buf_released[0], c.buf_released.size());
+			c.buf_released.clear();
+		} else {
+			write_ts(buf_read, wsize);
 		}
 
-		//Send TS
-		for (pos = 0; pos < rsize; pos += SIZE_TS_CHUNK) {
-			if (sock != -1)
-				sendto(sock, &buf[pos], SIZE_TS_CHUNK, 0,
-					rp->ai_addr, rp->ai_addrlen);
+		cnt += rsize;
+		cnt_out += wsize;
 
-			if (fd_out != -1)
-				write(fd_out, &buf[pos], SIZE_TS_CHUNK);
+		if (mon && context::get_time_ns() >= ns_report) {
+			fprintf(stderr, "\n");
+			mon->report(stderr, false);
+			ns_report = context::get_time_ns() + ns_mon;
 		}
 
-		cnt += rsize;
-
 		if (i > 1000) {
 			printf("\rcnt:%.3fMB    ", (double)cnt / 1024 / 1024);
 			fflush(stdout);
@@ -592,14 +542,41 @@ int main(int argc, char *argv[])
 		i++;
 	}
 
-	freeaddrinfo(resaddr);
+	if (proc_ts_flush(c)) {
+		write_ts(&c.buf_released[0], c.buf_released.size());
+		cnt_out += c.buf_released.size();
+		c.buf_released.clear();
+	}
+	if (c.cnt_held)
+		printf("\nhold: %" PRIu64 " packets are held, "
+			"%" PRIu64 " are released by timeout, "
+			"%" PRIu64 " by overflow\n",
+			c.cnt_held, c.cnt_hold_timeout, c.cnt_hold_overflow);
+
+	for (auto& s : sinks)
+		s->close();
+	for (auto& o : outs)
+		o->sink->close();
+	if (sink_srv)
+		sink_srv->close();
+	if (sink_mem)
+		sink_mem->close();
+	if (name_index)
+		rap.close();
+	if (mon)
+		mon->report(stderr, true);
+
+	if (strip)
+		printf("\nstrip: %zu of %zu packets are dropped\n",
+			(cnt - cnt_out) / SIZE_TS, cnt / SIZE_TS);
+
 	free(buf);
-	if (sock != -1)
-		close(sock);
+	if (src_udp)
+		src_udp->close();
+	if (src_replay)
+		src_replay->close();
 	if (fd_in != 0 && fd_in != -1)
 		close(fd_in);
-	if (fd_out != 1 && fd_out != -1)
-		close(fd_out);
 
 	return 0;
 }
@@ -19,6 +19,10 @@ public:
 		splicing_point_flag(0),
 		transport_private_data_flag(0),
 		adaptation_field_extension_flag(0),
+		program_clock_reference_base(0),
+		program_clock_reference_extension(0),
+		original_program_clock_reference_base(0),
+		original_program_clock_reference_extension(0),
 		transport_private_data_length(0),
 		adaptation_field_extension_length(0),
 		ltw_flag(0),
@@ -59,11 +63,15 @@ public:
 		adaptation_field_extension_flag      = bs.get_bits(1);
 
 		if (pcr_flag == 1) {
-			bs.skip_bits(48);
+			program_clock_reference_base      = bs.get_bits(33);
+			bs.skip_bits(6);
+			program_clock_reference_extension = bs.get_bits(9);
 		}
 
 		if (opcr_flag == 1) {
-			bs.skip_bits(48);
+			original_program_clock_reference_base      = bs.get_bits(33);
+			bs.skip_bits(6);
+			original_program_clock_reference_extension = bs.get_bits(9);
 		}
 
 		if (splicing_point_flag == 1) {
@@ -137,6 +145,15 @@ public:
 	{
 	}
 
+	/**
+	 * Get PCR in 27MHz.
+	 */
+	uint64_t get_pcr() const
+	{
+		return program_clock_reference_base * 300 +
+			program_clock_reference_extension;
+	}
+
 public:
 	uint32_t adaptation_field_length;
 	uint32_t discontinuity_indicator;
@@ -147,6 +164,10 @@ public:
 	uint32_t splicing_point_flag;
 	uint32_t transport_private_data_flag;
 	uint32_t adaptation_field_extension_flag;
+	uint64_t program_clock_reference_base;
+	uint32_t program_clock_reference_extension;
+	uint64_t original_program_clock_reference_base;
+	uint32_t original_program_clock_reference_extension;
 	uint32_t transport_private_data_length;
 
 	uint32_t adaptation_field_extension_length;
@@ -5,7 +5,10 @@
 #include <cstdint>
 #include <cinttypes>
 
+#include <vector>
+
 #include "packet.hpp"
+#include "crc32.hpp"
 
 class psi_base : public packet {
 public:
@@ -58,6 +61,48 @@ public:
 	template <class T>
 	void write_stub(bitstream<T>& bs)
 	{
+		bs.set_bits( 8, pointer_field           );
+		for (size_t i = 0; i < pointer_field; i++)
+			bs.set_bits(8, 0xff);
+
+		bs.set_bits( 8, table_id                );
+		bs.set_bits( 1, section_syntax_indicator);
+		bs.set_bits( 3, 3                       );
+		bs.set_bits(12, section_length          );
+	}
+
+	/**
+	 * Calculate CRC32 from table_id to the current position and
+	 * write it.
+	 *
+	 * @bs bit stream, current position is the head of CRC32 field
+	 * @st bit position of table_id
+	 * @return CRC32 value
+	 */
+	template <class T>
+	uint32_t write_crc32(bitstream<T>& bs, size_t st)
+	{
+		std::vector<uint8_t> sect;
+		uint32_t crc;
+
+		for (size_t i = st; i < bs.position_bits(); i += 8)
+			sect.push_back(bs.get_bits(i, 8));
+
+		crc = crc32_mpeg2::calc(&sect[0], sect.size());
+		bs.set_bits(32, crc);
+
+		return crc;
+	}
+
+	/**
+	 * Get bit position of table_id.
+	 *
+	 * @bs bit stream, current position is the head of pointer_field
+	 */
+	template <class T>
+	size_t get_table_id_position(bitstream<T>& bs) const
+	{
+		return bs.position_bits() + 8 + pointer_field * 8;
 	}
 
 	virtual void dump()
@@ -53,9 +53,8 @@ public:
 			return;
 		}
 
-		body.clear();
-		for (int i = 0; i < n; i++)
-			body.push_back(bs.get_bits(8));
+		body.resize(n);
+		bs.get_bytes(body.begin(), n);
 
 		crc_32 = bs.get_bits(32);
 	}
@@ -69,6 +68,24 @@ public:
 	template <class T>
 	void write_stub(bitstream<T>& bs)
 	{
+		size_t st = get_table_id_position(bs);
+
+		//5: size of table_id_extension .. last_section_number
+		//4: size of crc32
+		section_length = 5 + body.size() + 4;
+		psi_base::write_stub(bs);
+
+		bs.set_bits(16, table_id_extension    );
+		bs.set_bits( 2, 3                     );
+		bs.set_bits( 5, version_number        );
+		bs.set_bits( 1, current_next_indicator);
+		bs.set_bits( 8, section_number        );
+		bs.set_bits( 8, last_section_number   );
+
+		for (auto& e : body)
+			bs.set_bits(8, e);
+
+		crc_32 = write_crc32(bs, st);
 	}
 
 	virtual void dump()
@@ -45,6 +45,13 @@ public:
 	template <class T>
 	void write_stub(bitstream<T>& bs)
 	{
+		bs.set_bits(16, program_number);
+		bs.set_bits( 3, 7             );
+
+		if (program_number == 0)
+			bs.set_bits(13, network_pid   );
+		else
+			bs.set_bits(13, program_map_id);
 	}
 
 	virtual void dump()
@@ -124,6 +131,24 @@ public:
 	template <class T>
 	void write_stub(bitstream<T>& bs)
 	{
+		size_t st = get_table_id_position(bs);
+
+		//5: size of transport_stream_id .. last_section_number
+		//4: size of crc32
+		section_length = 5 + progs.size() * 4 + 4;
+		psi_base::write_stub(bs);
+
+		bs.set_bits(16, transport_stream_id   );
+		bs.set_bits( 2, 3                     );
+		bs.set_bits( 5, version_number        );
+		bs.set_bits( 1, current_next_indicator);
+		bs.set_bits( 8, section_number        );
+		bs.set_bits( 8, last_section_number   );
+
+		for (auto& e : progs)
+			e.write(bs);
+
+		crc_32 = write_crc32(bs, st);
 	}
 
 	virtual void dump()
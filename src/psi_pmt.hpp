@@ -30,6 +30,7 @@ enum stream_type {
 	STRM_ISO_14496_1_PES     = 0x12,
 	STRM_ISO_14496_1_SECTION = 0x13,
 	STRM_ISO_14496_10_VIDEO  = 0x1b,
+	STRM_H265_VIDEO          = 0x24,
 };
 
 class pmt_esinfo : public packet {
@@ -93,6 +94,27 @@ public:
 	template <class T>
 	void write_stub(bitstream<T>& bs)
 	{
+		es_info_length = get_descs_length(descs);
+
+		bs.set_bits( 8, stream_type   );
+		bs.set_bits( 3, 7             );
+		bs.set_bits(13, elementary_pid);
+		bs.set_bits( 4, 0xf           );
+		bs.set_bits(12, es_info_length);
+
+		for (auto& e : descs)
+			e->write(bs);
+	}
+
+	static uint32_t get_descs_length(const std::vector<std::shared_ptr<desc_base>>& d)
+	{
+		uint32_t len = 0;
+
+		//2: size of descriptor_tag, descriptor_length
+		for (auto& e : d)
+			len += 2 + e->descriptor_length;
+
+		return len;
 	}
 
 	virtual void dump()
@@ -110,6 +132,20 @@ public:
 		}
 	}
 
+	static bool is_video(uint32_t id)
+	{
+		switch (id) {
+		case STRM_ISO_11172_VIDEO:
+		case STRM_H262_VIDEO:
+		case STRM_ISO_14496_2_VISUAL:
+		case STRM_ISO_14496_10_VIDEO:
+		case STRM_H265_VIDEO:
+			return true;
+		}
+
+		return false;
+	}
+
 	static const char *get_stream_type_name(uint32_t id)
 	{
 		const char *name = "unknown";
@@ -163,6 +199,9 @@ public:
 		case STRM_ISO_14496_10_VIDEO:
 			name = "ISO_14496_10_VIDEO";
 			break;
+		case STRM_H265_VIDEO:
+			name = "H265_VIDEO";
+			break;
 		}
 
 		return name;
@@ -278,6 +317,37 @@ public:
 	template <class T>
 	void write_stub(bitstream<T>& bs)
 	{
+		size_t st = get_table_id_position(bs);
+
+		program_info_length = pmt_esinfo::get_descs_length(descs);
+
+		//9: size of program_number .. program_info_length
+		//4: size of crc32
+		section_length = 9 + program_info_length + 4;
+		for (auto& e : esinfos) {
+			//5: size of stream_type .. es_info_length
+			section_length += 5 + pmt_esinfo::get_descs_length(e.descs);
+		}
+		psi_base::write_stub(bs);
+
+		bs.set_bits(16, program_number        );
+		bs.set_bits( 2, 3                     );
+		bs.set_bits( 5, version_number        );
+		bs.set_bits( 1, current_next_indicator);
+		bs.set_bits( 8, section_number        );
+		bs.set_bits( 8, last_section_number   );
+		bs.set_bits( 3, 7                     );
+		bs.set_bits(13, pcr_pid               );
+		bs.set_bits( 4, 0xf                   );
+		bs.set_bits(12, program_info_length   );
+
+		for (auto& e : descs)
+			e->write(bs);
+
+		for (auto& e : esinfos)
+			e.write(bs);
+
+		crc_32 = write_crc32(bs, st);
 	}
 
 	virtual void dump()
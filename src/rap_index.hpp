@@ -0,0 +1,129 @@
+#ifndef RAP_INDEX_HPP__
+#define RAP_INDEX_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+
+#include "context.hpp"
+
+/**
+ * Sidecar index of random access points of the output.
+ *
+ * Packets are checked by the header and the flags of adaptation
+ * field only, while they are written. A line is written for each
+ * packet which has random_access_indicator, and for each start of
+ * PES of video:
+ *
+ *   offset pid pcr rap
+ *
+ * offset is the byte offset in the output, pcr is the last PCR of
+ * the PCR PID in 27MHz or '-', rap is 1 if random_access_indicator
+ * is set.
+ */
+class rap_index {
+public:
+	rap_index() :
+		fp(NULL), off(0), pid_pcr(0x1fff), valid_pcr(false), pcr(0),
+		cnt_point(0), cnt_rap(0)
+	{
+	}
+
+	virtual ~rap_index()
+	{
+		close();
+	}
+
+	int open(const char *name)
+	{
+		fp = fopen(name, "w");
+		if (!fp) {
+			perror("fopen(index)");
+			fprintf(stderr, "Failed to open '%s'\n", name);
+			return -errno;
+		}
+		fprintf(fp, "# offset pid pcr rap\n");
+
+		return 0;
+	}
+
+	/**
+	 * Check packets which are written to the output.
+	 *
+	 * @c   context, for stream types of ES
+	 * @buf TS packets
+	 * @len size of buf, multiple of TS packet size
+	 */
+	void write(const context& c, const char *buf, size_t len)
+	{
+		for (size_t pos = 0; pos + SIZE_TS <= len; pos += SIZE_TS) {
+			const uint8_t *p = (const uint8_t *)&buf[pos];
+			uint32_t pid = ((p[1] & 0x1f) << 8) | p[2];
+			bool pusi = p[1] & 0x40;
+			bool rai = false;
+
+			//Adaptation field has flags
+			if ((p[3] & 0x20) && p[4] > 0) {
+				rai = p[5] & 0x40;
+				if (p[5] & 0x10)
+					update_pcr(pid, p);
+			}
+
+			if (rai || (pusi && pmt_esinfo::is_video(c.es_type[pid])))
+				add(off + pos, pid, rai);
+		}
+		off += len;
+	}
+
+	void close()
+	{
+		if (!fp)
+			return;
+
+		fclose(fp);
+		fp = NULL;
+		printf("rap index: %" PRIu64 " points, %" PRIu64 " random access\n",
+			cnt_point, cnt_rap);
+	}
+
+protected:
+	void update_pcr(uint32_t pid, const uint8_t *p)
+	{
+		if (pid_pcr == 0x1fff)
+			pid_pcr = pid;
+		if (pid != pid_pcr || p[4] < 7)
+			return;
+
+		uint64_t base = ((uint64_t)p[6] << 25) | (p[7] << 17) |
+			(p[8] << 9) | (p[9] << 1) | (p[10] >> 7);
+		uint32_t ext = ((p[10] & 1) << 8) | p[11];
+
+		pcr = base * 300 + ext;
+		valid_pcr = true;
+	}
+
+	void add(uint64_t off_pkt, uint32_t pid, bool rai)
+	{
+		if (valid_pcr)
+			fprintf(fp, "%" PRIu64 " 0x%04x %" PRIu64 " %d\n",
+				off_pkt, pid, pcr, rai ? 1 : 0);
+		else
+			fprintf(fp, "%" PRIu64 " 0x%04x - %d\n",
+				off_pkt, pid, rai ? 1 : 0);
+		cnt_point++;
+		if (rai)
+			cnt_rap++;
+	}
+
+private:
+	FILE *fp;
+	uint64_t off;
+	uint32_t pid_pcr;
+	bool valid_pcr;
+	uint64_t pcr;
+	uint64_t cnt_point;
+	uint64_t cnt_rap;
+};
+
+#endif //RAP_INDEX_HPP__
@@ -0,0 +1,249 @@
+#ifndef SERVICE_FILTER_HPP__
+#define SERVICE_FILTER_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cinttypes>
+#include <cstring>
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "packet_ts.hpp"
+#include "psi_pat.hpp"
+#include "psi_pmt.hpp"
+
+#define SIZE_TS          188
+
+/**
+ * Select programs by program_number.
+ *
+ * Only PAT, SI (NIT, SDT, EIT, TOT), and PMT, PCR and ES of selected
+ * programs are passed. PAT is rewritten to list selected programs only.
+ * If no programs are selected, all PIDs are passed, or PIDs which are
+ * referenced by PAT and PMT are passed in strip mode.
+ */
+class service_filter {
+public:
+	service_filter() :
+		strip(false), cc_pat(0), valid_pat(false)
+	{
+		memset(pass_pid, 0, sizeof(pass_pid));
+		memset(pkt_pat, 0xff, sizeof(pkt_pat));
+	}
+
+	virtual ~service_filter()
+	{
+	}
+
+	void add_program(uint32_t program_number)
+	{
+		progs.insert(program_number);
+		update_pass();
+	}
+
+	/**
+	 * Drop null packets and PIDs which are not referenced by
+	 * PAT and PMT.
+	 */
+	void set_strip(bool f)
+	{
+		strip = f;
+		update_pass();
+	}
+
+	bool is_enabled() const
+	{
+		return !progs.empty() || strip;
+	}
+
+	bool is_selected(uint32_t program_number) const
+	{
+		return progs.empty() || progs.count(program_number) != 0;
+	}
+
+	/**
+	 * Check the PID is output or not.
+	 */
+	bool is_passed(uint32_t pid) const
+	{
+		return !is_enabled() || pass_pid[pid];
+	}
+
+	void update_pat(const psi_pat& pat)
+	{
+		psi_pat pat_out = pat;
+
+		pat_out.pointer_field = 0;
+		pat_out.progs.clear();
+		pmt_progs.clear();
+		for (auto& e : pat.progs) {
+			if (e.program_number != 0 && !is_selected(e.program_number))
+				continue;
+
+			pat_out.progs.push_back(e);
+			if (e.program_number != 0)
+				pmt_progs[e.program_map_id] = e.program_number;
+		}
+
+		//PAT of 1 packet can have 42 programs, enough for 1 TS
+		bitstream<uint8_t *> bs(pkt_pat, 4, SIZE_TS - 4);
+
+		memset(&pkt_pat[4], 0xff, SIZE_TS - 4);
+		pat_out.write(bs);
+		valid_pat = true;
+
+		update_pass();
+	}
+
+	void update_pmt(uint32_t pid, const psi_pmt& pmt)
+	{
+		std::vector<uint32_t>& v = pmt_pids[pid];
+		std::vector<uint32_t>& v_ecm = pmt_ecms[pid];
+
+		v.clear();
+		v.push_back(pmt.pcr_pid);
+		for (auto& e : pmt.esinfos)
+			v.push_back(e.elementary_pid);
+
+		v_ecm.clear();
+		add_ca_pids(v_ecm, pmt.descs);
+		for (auto& e : pmt.esinfos)
+			add_ca_pids(v_ecm, e.descs);
+
+		update_pass();
+	}
+
+	/**
+	 * Replace the PAT packet by rewritten PAT.
+	 *
+	 * @buf TS packet of PAT
+	 * @return 0 if success, -EAGAIN if PAT is not received yet or
+	 *         the packet is not head of PAT, the packet should be
+	 *         dropped
+	 */
+	int rewrite_pat(uint8_t *buf)
+	{
+		//All programs are output, keep original PAT
+		if (progs.empty())
+			return 0;
+
+		//payload_unit_start_indicator
+		if (!valid_pat || !(buf[1] & 0x40))
+			return -EAGAIN;
+
+		//sync byte, PUSI, PID 0x0000, payload only
+		pkt_pat[0] = 0x47;
+		pkt_pat[1] = 0x40;
+		pkt_pat[2] = 0x00;
+		pkt_pat[3] = 0x10 | cc_pat;
+		cc_pat = (cc_pat + 1) & 0xf;
+
+		memcpy(buf, pkt_pat, SIZE_TS);
+
+		return 0;
+	}
+
+	/**
+	 * Copy packets which are passed, and rewrite PAT.
+	 *
+	 * @in  TS packets
+	 * @len size of in, multiple of TS packet size
+	 * @out buffer for output, len bytes or larger
+	 * @return size of packets in out
+	 */
+	size_t filter(const char *in, size_t len, char *out)
+	{
+		size_t n = 0;
+
+		for (size_t pos = 0; pos + SIZE_TS <= len; pos += SIZE_TS) {
+			const uint8_t *pkt = (const uint8_t *)&in[pos];
+			uint32_t pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+
+			if (!is_passed(pid) || pid == 0x1fff)
+				continue;
+
+			memcpy(&out[n], pkt, SIZE_TS);
+			if (pid == 0 && rewrite_pat((uint8_t *)&out[n]))
+				continue;
+			n += SIZE_TS;
+		}
+
+		return n;
+	}
+
+protected:
+	void update_pass()
+	{
+		static const uint32_t pids_si[] = {
+			//PAT, NIT, SDT/BAT, EIT, TDT/TOT
+			0x0000, 0x0010, 0x0011, 0x0012, 0x0014,
+		};
+
+		//All programs in strip mode
+		bool all = progs.empty();
+
+		memset(pass_pid, 0, sizeof(pass_pid));
+		for (auto pid : pids_si)
+			pass_pid[pid] = 1;
+		if (all) {
+			//Reserved for PSI and SI
+			for (uint32_t pid = 0; pid <= 0x002f; pid++)
+				pass_pid[pid] = 1;
+		}
+
+		for (auto& e : pmt_progs) {
+			if (!is_selected(e.second))
+				continue;
+
+			pass_pid[e.first] = 1;
+
+			auto it = pmt_pids.find(e.first);
+			if (it != pmt_pids.end()) {
+				for (auto pid : it->second) {
+					if (pid < 0x1fff)
+						pass_pid[pid] = 1;
+				}
+			}
+
+			auto it_ecm = pmt_ecms.find(e.first);
+			if (all && it_ecm != pmt_ecms.end()) {
+				for (auto pid : it_ecm->second) {
+					if (pid < 0x1fff)
+						pass_pid[pid] = 1;
+				}
+			}
+		}
+	}
+
+	static void add_ca_pids(std::vector<uint32_t>& v,
+		const std::vector<std::shared_ptr<desc_base>>& descs)
+	{
+		for (auto& e : descs) {
+			if (e->descriptor_tag != DESC_CA)
+				continue;
+
+			const desc_ca& dsc = dynamic_cast<const desc_ca&>(*e);
+
+			v.push_back(dsc.ca_pid);
+		}
+	}
+
+private:
+	std::set<uint32_t> progs;
+	//PID of PMT -> program_number
+	std::map<uint32_t, uint32_t> pmt_progs;
+	//PID of PMT -> PCR and ES PIDs
+	std::map<uint32_t, std::vector<uint32_t>> pmt_pids;
+	//PID of PMT -> ECM PIDs
+	std::map<uint32_t, std::vector<uint32_t>> pmt_ecms;
+	bool strip;
+	uint8_t pass_pid[0x2000];
+
+	uint8_t pkt_pat[SIZE_TS];
+	uint32_t cc_pat;
+	bool valid_pat;
+};
+
+#endif //SERVICE_FILTER_HPP__
@@ -0,0 +1,103 @@
+#include <cstdio>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "sink_shm.hpp"
+
+//Max size of packets copied from the ring at once
+#define SHM_READER_BLOCK         (188 * 1024)
+
+/**
+ * Example of consumer of shared memory output.
+ *
+ * Packets are copied from the ring to a local buffer, and are checked
+ * and written to the output if given only after consume() confirms
+ * that the producer did not overwrite them while copying.
+ */
+
+void usage(int argc, char *argv[])
+{
+	fprintf(stderr, "usage: %s [-o output] name\n\n"
+		"  -o output : Output file name, '-' means stdout\n"
+		"  name      : Name of shared memory, such as /arib\n",
+		argv[0]);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name_out = NULL;
+	std::unique_ptr<sink_base> out;
+	sink_shm_reader rd;
+	std::vector<char> buf(SHM_READER_BLOCK);
+	uint64_t cnt = 0, cnt_sync = 0;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "o:h")) != -1) {
+		switch (opt) {
+		case 'o':
+			name_out = optarg;
+			break;
+		default:
+			usage(argc, argv);
+			return -1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argc, argv);
+		return -1;
+	}
+
+	if (name_out) {
+		out.reset(open_sink(name_out));
+		if (!out)
+			return -1;
+	}
+	if (rd.attach(argv[optind]))
+		return -1;
+
+	while (1) {
+		ret = rd.wait(1000);
+		if (ret == -ETIMEDOUT)
+			continue;
+		else if (ret)
+			break;
+
+		size_t len;
+		const char *p = rd.peek(len);
+
+		len = std::min(len, buf.size());
+		memcpy(&buf[0], p, len);
+		//Torn by the producer, packets are skipped
+		if (!rd.consume(len))
+			continue;
+
+		for (size_t pos = 0; pos < len; pos += 188) {
+			if (buf[pos] != 0x47)
+				cnt_sync++;
+		}
+		if (out)
+			out->write(&buf[0], len);
+		cnt += len;
+	}
+
+	if (out)
+		out->close();
+
+	fprintf(stderr, "shm: %" PRIu64 " bytes, %" PRIu64 " bytes overrun, "
+		"%" PRIu64 " sync errors\n",
+		cnt, rd.get_overrun(), cnt_sync);
+
+	return 0;
+}
@@ -0,0 +1,948 @@
+#ifndef SINK_HPP__
+#define SINK_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netdb.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//Size of UDP datagram, 7 TS packets
+#define SINK_SIZE_DATAGRAM       (188 * 7)
+//Max number of datagrams sent by a system call
+#define SINK_MAX_DATAGRAMS       64
+//Size of a write of batched sink, multiple of datagram
+#define SINK_SIZE_BATCH          (188 * 7 * 32)
+//Size of a block of asynchronous sink
+#define SINK_ASYNC_BLOCK         (188 * 7 * 64)
+//Max number of queued blocks of asynchronous sink
+#define SINK_ASYNC_BLOCKS        64
+//Size of a vmsplice of pipe sink, multiple of TS packet and page
+#define SINK_PIPE_BLOCK          (188 * 1024)
+//Requested size of pipe buffer
+#define SINK_PIPE_SIZE           (1024 * 1024)
+//Size of a write of recording sink, multiple of TS packet and page
+#define SINK_RECORD_BLOCK        (188 * 4096)
+//Size of a preallocation of recording sink
+#define SINK_RECORD_PREALLOC     (64 * 1024 * 1024)
+//Alignment of buffer for O_DIRECT
+#define SINK_RECORD_ALIGN        4096
+
+enum sink_flag {
+	//Write files by O_DIRECT
+	SINK_FLAG_DIRECT = 0x01,
+};
+
+/**
+ * Destination of TS packets.
+ */
+class sink_base {
+public:
+	sink_base()
+	{
+	}
+
+	virtual ~sink_base()
+	{
+	}
+
+	/**
+	 * Write packets.
+	 *
+	 * @buf TS packets
+	 * @len size of buf
+	 * @return 0 if success, otherwise negative error code
+	 */
+	virtual int write(const char *buf, size_t len) = 0;
+
+	/**
+	 * Write buffered packets if exist.
+	 */
+	virtual int flush()
+	{
+		return 0;
+	}
+
+	virtual void close() = 0;
+
+	/**
+	 * Check packets may be lost if the sink is slow, such as network.
+	 * Otherwise packets must not be dropped, such as files.
+	 */
+	virtual bool is_live() const
+	{
+		return false;
+	}
+};
+
+/**
+ * File, or stdout if name is '-'.
+ */
+class sink_fd : public sink_base {
+public:
+	sink_fd() :
+		fd(-1)
+	{
+	}
+
+	virtual ~sink_fd()
+	{
+		close();
+	}
+
+	int open(const char *name)
+	{
+		if (strcmp(name, "-") == 0) {
+			fd = 1;
+			return 0;
+		}
+
+		fd = ::open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1) {
+			perror("open(out)");
+			fprintf(stderr, "Failed to open '%s'\n", name);
+			return -errno;
+		}
+
+		return 0;
+	}
+
+	int write(const char *buf, size_t len)
+	{
+		while (len > 0) {
+			ssize_t n = ::write(fd, buf, len);
+
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				perror("write(out)");
+				return -errno;
+			}
+
+			buf += n;
+			len -= n;
+		}
+
+		return 0;
+	}
+
+	void close()
+	{
+		if (fd != -1 && fd != 1)
+			::close(fd);
+		fd = -1;
+	}
+
+private:
+	int fd;
+};
+
+/**
+ * Regular file for long recording.
+ *
+ * Packets are written by large aligned blocks to preallocated area.
+ * Written blocks are flushed by sync_file_range() and dropped from the
+ * page cache, so long recording does not evict other pages.
+ */
+class sink_record : public sink_base {
+public:
+	sink_record() :
+		fd(-1), block(NULL), len_block(0), pos(0), size_alloc(0),
+		direct(false), prealloc(true)
+	{
+	}
+
+	virtual ~sink_record()
+	{
+		close();
+	}
+
+	int open(const char *name, unsigned int flags)
+	{
+		direct = flags & SINK_FLAG_DIRECT;
+
+		fd = ::open(name, O_WRONLY | O_CREAT | O_TRUNC |
+			(direct ? O_DIRECT : 0), 0644);
+		if (fd == -1 && direct && errno == EINVAL) {
+			fprintf(stderr, "O_DIRECT is not supported '%s'\n", name);
+			direct = false;
+			fd = ::open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		}
+		if (fd == -1) {
+			perror("open(out)");
+			fprintf(stderr, "Failed to open '%s'\n", name);
+			return -errno;
+		}
+
+		if (posix_memalign((void **)&block, SINK_RECORD_ALIGN,
+		    SINK_RECORD_BLOCK)) {
+			fprintf(stderr, "Failed to allocate buffer.\n");
+			block = NULL;
+			return -ENOMEM;
+		}
+
+		return 0;
+	}
+
+	int write(const char *buf, size_t len)
+	{
+		int ret;
+
+		while (len > 0) {
+			size_t n = SINK_RECORD_BLOCK - len_block;
+
+			if (n > len)
+				n = len;
+			memcpy(&block[len_block], buf, n);
+			len_block += n;
+			buf += n;
+			len -= n;
+
+			if (len_block == SINK_RECORD_BLOCK) {
+				ret = write_block();
+				if (ret)
+					return ret;
+			}
+		}
+
+		return 0;
+	}
+
+	/**
+	 * Write the rest of block. Offset is not aligned after this,
+	 * so O_DIRECT is turned off.
+	 */
+	int flush()
+	{
+		if (len_block == 0)
+			return 0;
+
+		if (direct) {
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+			direct = false;
+		}
+
+		return write_block();
+	}
+
+	void close()
+	{
+		if (fd == -1)
+			return;
+
+		flush();
+		//Release preallocated blocks beyond the end
+		if (size_alloc > pos && ftruncate(fd, pos) == -1)
+			perror("ftruncate(out)");
+		::close(fd);
+		fd = -1;
+		free(block);
+		block = NULL;
+	}
+
+protected:
+	int write_block()
+	{
+		size_t done = 0;
+
+		allocate(pos + len_block);
+
+		while (done < len_block) {
+			ssize_t n = ::write(fd, &block[done], len_block - done);
+
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				perror("write(out)");
+				return -errno;
+			}
+			done += n;
+		}
+
+		drop_cache(pos, len_block);
+		pos += len_block;
+		len_block = 0;
+
+		return 0;
+	}
+
+	/**
+	 * Reserve blocks ahead of the write head, file size is kept.
+	 */
+	void allocate(uint64_t end)
+	{
+		if (!prealloc || end <= size_alloc)
+			return;
+
+		if (fallocate(fd, FALLOC_FL_KEEP_SIZE, size_alloc,
+		    SINK_RECORD_PREALLOC) == -1) {
+			//Not supported by some filesystems, not an error
+			prealloc = false;
+			return;
+		}
+		size_alloc += SINK_RECORD_PREALLOC;
+	}
+
+	/**
+	 * Start writeback of the block just written, and drop the
+	 * previous block which writeback should be finished.
+	 */
+	void drop_cache(uint64_t off, size_t len)
+	{
+		if (direct)
+			return;
+
+		sync_file_range(fd, off, len, SYNC_FILE_RANGE_WRITE);
+		if (off < SINK_RECORD_BLOCK)
+			return;
+
+		off -= SINK_RECORD_BLOCK;
+		sync_file_range(fd, off, SINK_RECORD_BLOCK,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(fd, off, SINK_RECORD_BLOCK, POSIX_FADV_DONTNEED);
+	}
+
+private:
+	int fd;
+	char *block;
+	size_t len_block;
+	uint64_t pos;
+	uint64_t size_alloc;
+	bool direct;
+	bool prealloc;
+};
+
+/**
+ * Pipe, such as stdout of 'arib_descramble ... - | ffmpeg -i -'.
+ *
+ * The caller gets the space of the ring by get_buffer(), and reads and
+ * descrambles packets in place. Packets written from the head of the
+ * space are not copied, and pages of blocks are given to the pipe by
+ * vmsplice() without copy. Other packets are copied to the ring. Pages
+ * of a block
+ * are reused only after the reader consumed them; blocks are rotated
+ * in a ring larger than the pipe buffer, and the pipe cannot hold
+ * more pages than its buffer. It is not true if the reader moves
+ * pages to other pipe by splice() or tee(), so SPLICE_F_GIFT is not
+ * used and the ring is kept enough large.
+ */
+class sink_pipe : public sink_base {
+public:
+	sink_pipe() :
+		fd(-1), ring(NULL), size_ring(0), pos_fill(0), pos_sent(0)
+	{
+	}
+
+	virtual ~sink_pipe()
+	{
+		close();
+	}
+
+	/**
+	 * Check the fd can be used by this sink.
+	 */
+	static bool is_pipe(int fd)
+	{
+		struct stat st;
+
+		if (fstat(fd, &st) == -1)
+			return false;
+
+		return S_ISFIFO(st.st_mode);
+	}
+
+	int open(int f)
+	{
+		int size_pipe;
+
+		fd = f;
+
+		//Not an error, keep default size if failed
+		fcntl(fd, F_SETPIPE_SZ, SINK_PIPE_SIZE);
+		size_pipe = fcntl(fd, F_GETPIPE_SZ);
+		if (size_pipe == -1) {
+			perror("fcntl(F_GETPIPE_SZ)");
+			return -errno;
+		}
+
+		//Reused blocks must be out of the pipe
+		size_ring = size_pipe + SINK_PIPE_BLOCK * 2;
+		size_ring -= size_ring % SINK_PIPE_BLOCK;
+		ring = (char *)mmap(NULL, size_ring, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ring == MAP_FAILED) {
+			perror("mmap(pipe)");
+			ring = NULL;
+			return -errno;
+		}
+
+		return 0;
+	}
+
+	/**
+	 * Get the space of the ring to fill packets in place.
+	 *
+	 * @len size of the space
+	 * @return head of the space, or NULL if len is too large
+	 */
+	char *get_buffer(size_t len)
+	{
+		if (!ring || len > SINK_PIPE_BLOCK)
+			return NULL;
+
+		if (size_ring - pos_fill < len) {
+			if (flush())
+				return NULL;
+			pos_fill = 0;
+			pos_sent = 0;
+		}
+
+		return &ring[pos_fill];
+	}
+
+	int write(const char *buf, size_t len)
+	{
+		int ret;
+
+		if (ring && buf == &ring[pos_fill]) {
+			//Filled in place by get_buffer()
+			pos_fill += len;
+			if (pos_fill - pos_sent >= SINK_PIPE_BLOCK ||
+			    pos_fill == size_ring)
+				return flush();
+
+			return 0;
+		}
+
+		while (len > 0) {
+			size_t end = pos_fill - pos_fill % SINK_PIPE_BLOCK +
+				SINK_PIPE_BLOCK;
+			size_t n = end - pos_fill;
+
+			if (n > len)
+				n = len;
+			memcpy(&ring[pos_fill], buf, n);
+			pos_fill += n;
+			buf += n;
+			len -= n;
+
+			if (pos_fill == end) {
+				ret = flush();
+				if (ret)
+					return ret;
+			}
+		}
+
+		return 0;
+	}
+
+	int flush()
+	{
+		struct iovec iov;
+
+		iov.iov_base = &ring[pos_sent];
+		iov.iov_len = pos_fill - pos_sent;
+
+		while (iov.iov_len > 0) {
+			ssize_t n = vmsplice(fd, &iov, 1, 0);
+
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				perror("vmsplice(out)");
+				return -errno;
+			}
+
+			iov.iov_base = (char *)iov.iov_base + n;
+			iov.iov_len -= n;
+		}
+
+		pos_sent = pos_fill;
+		if (pos_fill == size_ring) {
+			pos_fill = 0;
+			pos_sent = 0;
+		}
+
+		return 0;
+	}
+
+	void close()
+	{
+		if (ring) {
+			flush();
+			munmap(ring, size_ring);
+		}
+		ring = NULL;
+		fd = -1;
+	}
+
+private:
+	int fd;
+	char *ring;
+	size_t size_ring;
+	size_t pos_fill;
+	size_t pos_sent;
+};
+
+/**
+ * UDP destination, packets are sent by datagrams of 7 TS packets
+ * or less. Datagrams of a write are sent by a few sendmmsg() calls.
+ */
+class sink_udp : public sink_base {
+public:
+	sink_udp() :
+		sock(-1), resaddr(NULL)
+	{
+	}
+
+	virtual ~sink_udp()
+	{
+		close();
+	}
+
+	bool is_live() const
+	{
+		return true;
+	}
+
+	int open(const char *hostname, const char *servname)
+	{
+		struct addrinfo hints;
+		int ret;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_flags = 0;
+		hints.ai_protocol = 0;
+		ret = getaddrinfo(hostname, servname, &hints, &resaddr);
+		if (ret) {
+			fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+			fprintf(stderr, "Failed to resolve '%s:%s'\n",
+				hostname, servname);
+			resaddr = NULL;
+			return -EINVAL;
+		}
+
+		sock = socket(resaddr->ai_family, resaddr->ai_socktype,
+			resaddr->ai_protocol);
+		if (sock == -1) {
+			perror("socket(INET, DGRAM)");
+			fprintf(stderr, "Failed to connect '%s:%s'\n",
+				hostname, servname);
+			return -errno;
+		}
+
+		return 0;
+	}
+
+	int write(const char *buf, size_t len)
+	{
+		struct mmsghdr msgs[SINK_MAX_DATAGRAMS];
+		struct iovec iovs[SINK_MAX_DATAGRAMS];
+		size_t pos = 0;
+
+		while (pos < len) {
+			unsigned int cnt = 0;
+
+			memset(msgs, 0, sizeof(msgs));
+			for (; cnt < SINK_MAX_DATAGRAMS && pos < len; cnt++) {
+				size_t n = len - pos;
+
+				if (n > SINK_SIZE_DATAGRAM)
+					n = SINK_SIZE_DATAGRAM;
+
+				iovs[cnt].iov_base = (void *)&buf[pos];
+				iovs[cnt].iov_len = n;
+				msgs[cnt].msg_hdr.msg_name = resaddr->ai_addr;
+				msgs[cnt].msg_hdr.msg_namelen = resaddr->ai_addrlen;
+				msgs[cnt].msg_hdr.msg_iov = &iovs[cnt];
+				msgs[cnt].msg_hdr.msg_iovlen = 1;
+				pos += n;
+			}
+
+			//UDP is lossy, errors are not reported as before
+			for (unsigned int i = 0; i < cnt; ) {
+				int ret = sendmmsg(sock, &msgs[i], cnt - i, 0);
+
+				if (ret <= 0)
+					break;
+				i += ret;
+			}
+		}
+
+		return 0;
+	}
+
+	void close()
+	{
+		if (sock != -1)
+			::close(sock);
+		sock = -1;
+		if (resaddr)
+			freeaddrinfo(resaddr);
+		resaddr = NULL;
+	}
+
+private:
+	int sock;
+	struct addrinfo *resaddr;
+};
+
+/**
+ * Write same packets to two or more sinks.
+ */
+class sink_tee : public sink_base {
+public:
+	sink_tee(const std::vector<std::shared_ptr<sink_base>>& s) :
+		sinks(s)
+	{
+	}
+
+	virtual ~sink_tee()
+	{
+		close();
+	}
+
+	int write(const char *buf, size_t len)
+	{
+		int ret = 0;
+
+		for (auto& s : sinks) {
+			int r = s->write(buf, len);
+
+			if (r)
+				ret = r;
+		}
+
+		return ret;
+	}
+
+	int flush()
+	{
+		int ret = 0;
+
+		for (auto& s : sinks) {
+			int r = s->flush();
+
+			if (r)
+				ret = r;
+		}
+
+		return ret;
+	}
+
+	void close()
+	{
+		for (auto& s : sinks)
+			s->close();
+		sinks.clear();
+	}
+
+private:
+	std::vector<std::shared_ptr<sink_base>> sinks;
+};
+
+/**
+ * Gather packets and write to other sink by large blocks.
+ *
+ * Blocks are multiple of UDP datagram, so datagrams are always full
+ * except the last one.
+ */
+class sink_batch : public sink_base {
+public:
+	sink_batch(std::shared_ptr<sink_base> s, size_t sz) :
+		sink(s), size_batch(sz)
+	{
+		block.reserve(size_batch);
+	}
+
+	virtual ~sink_batch()
+	{
+		close();
+	}
+
+	int write(const char *buf, size_t len)
+	{
+		int ret;
+
+		//Bypass the buffer if enough size
+		if (block.empty() && len >= size_batch) {
+			size_t n = len - len % size_batch;
+
+			ret = sink->write(buf, n);
+			if (ret)
+				return ret;
+			buf += n;
+			len -= n;
+		}
+
+		while (len > 0) {
+			size_t n = size_batch - block.size();
+
+			if (n > len)
+				n = len;
+			block.insert(block.end(), buf, buf + n);
+			buf += n;
+			len -= n;
+
+			if (block.size() == size_batch) {
+				ret = flush();
+				if (ret)
+					return ret;
+			}
+		}
+
+		return 0;
+	}
+
+	int flush()
+	{
+		int ret;
+
+		if (block.empty())
+			return 0;
+
+		ret = sink->write(&block[0], block.size());
+		block.clear();
+
+		return ret;
+	}
+
+	void close()
+	{
+		if (!sink)
+			return;
+
+		flush();
+		sink->close();
+		sink.reset();
+	}
+
+private:
+	std::shared_ptr<sink_base> sink;
+	std::vector<char> block;
+	size_t size_batch;
+};
+
+/**
+ * Write packets to other sink by background thread.
+ *
+ * Packets are gathered into blocks. If the sink is too slow and the
+ * queue is full, new blocks are dropped so the caller never waits, if
+ * the sink is live. Otherwise the caller waits for the queue, so files
+ * never lose packets.
+ */
+class sink_async : public sink_base {
+public:
+	sink_async(sink_base *s) :
+		sink(s), live(s->is_live()), stopping(false), dropping(false),
+		cnt_drop(0)
+	{
+		block.reserve(SINK_ASYNC_BLOCK);
+		th = std::thread(&sink_async::run, this);
+	}
+
+	virtual ~sink_async()
+	{
+		close();
+	}
+
+	int write(const char *buf, size_t len)
+	{
+		while (len > 0) {
+			size_t n = SINK_ASYNC_BLOCK - block.size();
+
+			if (n > len)
+				n = len;
+			block.insert(block.end(), buf, buf + n);
+			buf += n;
+			len -= n;
+
+			if (block.size() == SINK_ASYNC_BLOCK)
+				flush();
+		}
+
+		return 0;
+	}
+
+	int flush()
+	{
+		if (block.empty())
+			return 0;
+
+		{
+			std::unique_lock<std::mutex> lk(mtx);
+
+			if (!live)
+				cond_space.wait(lk, [this] {
+					return blocks.size() < SINK_ASYNC_BLOCKS;
+				});
+
+			if (blocks.size() < SINK_ASYNC_BLOCKS) {
+				blocks.push_back(std::move(block));
+				dropping = false;
+			} else {
+				//Report at the start of each loss
+				if (!dropping)
+					fprintf(stderr, "sink: queue is full, "
+						"blocks are dropped.\n");
+				dropping = true;
+				cnt_drop += block.size();
+			}
+		}
+		cond.notify_one();
+
+		block.clear();
+		block.reserve(SINK_ASYNC_BLOCK);
+
+		return 0;
+	}
+
+	void close()
+	{
+		if (!th.joinable())
+			return;
+
+		flush();
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			stopping = true;
+		}
+		cond.notify_one();
+		th.join();
+
+		if (cnt_drop)
+			fprintf(stderr, "sink: %" PRIu64 " bytes are dropped.\n",
+				cnt_drop);
+		sink->close();
+	}
+
+	uint64_t get_dropped()
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+
+		return cnt_drop;
+	}
+
+protected:
+	void run()
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+
+		while (1) {
+			cond.wait(lk, [this] { return stopping || !blocks.empty(); });
+			if (blocks.empty())
+				break;
+
+			std::vector<char> b = std::move(blocks.front());
+
+			blocks.pop_front();
+			lk.unlock();
+			cond_space.notify_one();
+			sink->write(&b[0], b.size());
+			lk.lock();
+		}
+	}
+
+private:
+	std::shared_ptr<sink_base> sink;
+	bool live;
+	std::vector<char> block;
+	std::thread th;
+
+	std::mutex mtx;
+	std::condition_variable cond;
+	//Notified when a block is taken from the queue
+	std::condition_variable cond_space;
+	std::deque<std::vector<char>> blocks;
+	bool stopping;
+	bool dropping;
+	uint64_t cnt_drop;
+};
+
+/**
+ * Open the sink by name.
+ *
+ * @name  'udp://host:port' for UDP, otherwise file name or '-',
+ *        stdout is written by vmsplice() if it is a pipe, and regular
+ *        files are written by recording sink
+ * @flags SINK_FLAG_xxx
+ * @return new sink, caller must delete it, or NULL if failed
+ */
+inline sink_base *open_sink(const char *name, unsigned int flags = 0)
+{
+	static const char prefix_udp[] = "udp://";
+	struct stat st;
+
+	if (strncmp(name, prefix_udp, strlen(prefix_udp)) == 0) {
+		std::string addr = name + strlen(prefix_udp);
+		size_t colon = addr.rfind(':');
+		std::unique_ptr<sink_udp> s(new sink_udp);
+
+		if (colon == std::string::npos) {
+			fprintf(stderr, "No port number '%s'\n", name);
+			return NULL;
+		}
+
+		std::string host = addr.substr(0, colon);
+		std::string serv = addr.substr(colon + 1);
+
+		//[::1]:port for IPv6
+		if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+			host = host.substr(1, host.size() - 2);
+
+		if (s->open(host.c_str(), serv.c_str()))
+			return NULL;
+
+		return s.release();
+	}
+
+	if (strcmp(name, "-") == 0 && sink_pipe::is_pipe(1)) {
+		std::unique_ptr<sink_pipe> s(new sink_pipe);
+
+		if (s->open(1))
+			return NULL;
+
+		return s.release();
+	}
+
+	//New file or regular file, not FIFO nor device
+	if (strcmp(name, "-") != 0 &&
+	    (stat(name, &st) == -1 || S_ISREG(st.st_mode))) {
+		std::unique_ptr<sink_record> s(new sink_record);
+
+		if (s->open(name, flags))
+			return NULL;
+
+		return s.release();
+	}
+
+	std::unique_ptr<sink_fd> s(new sink_fd);
+
+	if (s->open(name))
+		return NULL;
+
+	return s.release();
+}
+
+#endif //SINK_HPP__
@@ -0,0 +1,218 @@
+#ifndef SINK_PACE_HPP__
+#define SINK_PACE_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <memory>
+#include <vector>
+
+#include "packet_ts.hpp"
+#include "sink.hpp"
+
+//Size of a paced write, 1 UDP datagram
+#define SINK_PACE_UNIT           (188 * 7)
+//Max size of packets without PCR, written without pacing if exceeded
+#define SINK_PACE_MAX_PENDING    (188 * 7 * 4096)
+//Max interval of PCRs in 27MHz, reset the clock if exceeded
+#define SINK_PACE_MAX_INTERVAL   (27000000ULL / 2)
+//Max delay of writes in nsec, reset the clock if exceeded
+#define SINK_PACE_MAX_DELAY      500000000ULL
+//Wrap around of PCR, 2^33 * 300
+#define SINK_PACE_PCR_WRAP       (0x200000000ULL * 300)
+
+/**
+ * Write packets to other sink at the rate of PCR.
+ *
+ * Packets between two PCRs are kept, and written by datagrams at the
+ * time interpolated by the PCRs. The caller is blocked until the time
+ * of the last datagram, so the input is also paced.
+ */
+class sink_pace : public sink_base {
+public:
+	sink_pace(std::shared_ptr<sink_base> s) :
+		sink(s), pid_pcr(0x1fff), valid_clock(false), pcr_base(0),
+		ns_base(0), pcr_last(0), cnt_reset(0)
+	{
+	}
+
+	virtual ~sink_pace()
+	{
+		close();
+	}
+
+	int write(const char *buf, size_t len)
+	{
+		int ret;
+
+		for (size_t pos = 0; pos + 188 <= len; pos += 188) {
+			uint64_t pcr;
+
+			if (get_pcr(&buf[pos], pcr)) {
+				ret = write_segment(pcr);
+				if (ret)
+					return ret;
+			}
+
+			pending.insert(pending.end(), &buf[pos], &buf[pos + 188]);
+		}
+
+		//PCR is not found, give up pacing
+		if (pending.size() >= SINK_PACE_MAX_PENDING) {
+			valid_clock = false;
+			return flush();
+		}
+
+		return 0;
+	}
+
+	int flush()
+	{
+		int ret;
+
+		if (pending.empty())
+			return 0;
+
+		ret = sink->write(&pending[0], pending.size());
+		pending.clear();
+		if (ret)
+			return ret;
+
+		return sink->flush();
+	}
+
+	void close()
+	{
+		if (!sink)
+			return;
+
+		flush();
+		sink->close();
+		sink.reset();
+
+		if (cnt_reset > 1)
+			fprintf(stderr, "pace: clock is reset %" PRIu64 " times.\n",
+				cnt_reset);
+	}
+
+protected:
+	/**
+	 * Find PCR of the PCR PID, the first PID which has PCR.
+	 */
+	bool get_pcr(const char *pkt, uint64_t& pcr)
+	{
+		//Packet is not modified by peek
+		bitstream<char *> bs(const_cast<char *>(pkt), 0, 188);
+		packet_ts ts;
+
+		//Check adaptation field and PCR flag before parsing
+		if (!(pkt[3] & 0x20) || (uint8_t)pkt[4] == 0 || !(pkt[5] & 0x10))
+			return false;
+
+		ts.set_light_mode(true);
+		ts.peek(bs);
+		if (ts.is_error() || !ts.adapt.pcr_flag)
+			return false;
+		if (pid_pcr == 0x1fff)
+			pid_pcr = ts.pid;
+		if (ts.pid != pid_pcr)
+			return false;
+
+		pcr = ts.adapt.get_pcr();
+		if (ts.adapt.discontinuity_indicator)
+			valid_clock = false;
+
+		return true;
+	}
+
+	/**
+	 * Write packets before the new PCR, from the time of previous
+	 * PCR to the time of new PCR.
+	 */
+	int write_segment(uint64_t pcr)
+	{
+		uint64_t ns_now = get_time(), d;
+		int ret;
+
+		d = (pcr + SINK_PACE_PCR_WRAP - pcr_last) % SINK_PACE_PCR_WRAP;
+		if (valid_clock && (d > SINK_PACE_MAX_INTERVAL ||
+		    ns_now > to_time(pcr) + SINK_PACE_MAX_DELAY))
+			valid_clock = false;
+
+		if (!valid_clock) {
+			//Start new clock, packets are written now
+			pcr_base = pcr;
+			ns_base = ns_now;
+			pcr_last = pcr;
+			valid_clock = true;
+			cnt_reset++;
+
+			return flush();
+		}
+
+		uint64_t ns_st = to_time(pcr_last);
+		uint64_t ns_end = to_time(pcr);
+		size_t len = pending.size();
+
+		for (size_t pos = 0; pos < len; pos += SINK_PACE_UNIT) {
+			size_t n = len - pos;
+
+			if (n > SINK_PACE_UNIT)
+				n = SINK_PACE_UNIT;
+
+			sleep_until(ns_st + (ns_end - ns_st) * pos / len);
+			ret = sink->write(&pending[pos], n);
+			if (ret)
+				return ret;
+		}
+		pending.clear();
+		pcr_last = pcr;
+
+		return 0;
+	}
+
+	uint64_t to_time(uint64_t pcr) const
+	{
+		uint64_t d = (pcr + SINK_PACE_PCR_WRAP - pcr_base) %
+			SINK_PACE_PCR_WRAP;
+
+		return ns_base + d * 1000 / 27;
+	}
+
+	static uint64_t get_time()
+	{
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+
+	static void sleep_until(uint64_t ns)
+	{
+		struct timespec ts;
+
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+		    &ts, NULL) == EINTR) {
+		}
+	}
+
+private:
+	std::shared_ptr<sink_base> sink;
+	std::vector<char> pending;
+	uint32_t pid_pcr;
+
+	bool valid_clock;
+	uint64_t pcr_base;
+	uint64_t ns_base;
+	uint64_t pcr_last;
+	uint64_t cnt_reset;
+};
+
+#endif //SINK_PACE_HPP__
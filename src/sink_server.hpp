@@ -0,0 +1,487 @@
+#ifndef SINK_SERVER_HPP__
+#define SINK_SERVER_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <netdb.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sink.hpp"
+
+//Size of the ring buffer shared by clients
+#define SINK_SERVER_RING         (188 * 7 * 8192)
+//Max number of clients
+#define SINK_SERVER_CLIENTS      32
+//Max size of a send
+#define SINK_SERVER_SEND         (188 * 7 * 64)
+
+enum sink_server_policy {
+	//Skip to the latest packet
+	SINK_SERVER_SKIP,
+	//Disconnect the client
+	SINK_SERVER_DROP,
+};
+
+/**
+ * Stream server on TCP or Unix domain socket.
+ *
+ * Packets are stored to one ring buffer, and each client has its own
+ * read cursor. The writer never waits for clients, the server thread
+ * holds the lock only to copy a chunk of the ring for a client and
+ * sends it without the lock. If a client is behind more than half of
+ * the ring, it skips to the latest packet or is disconnected according
+ * to the policy.
+ */
+class sink_server : public sink_base {
+public:
+	sink_server() :
+		fd_listen(-1), fd_wake(-1), policy(SINK_SERVER_SKIP),
+		dev_unix(0), ino_unix(0), head(0), need_wake(false), stopping(false)
+	{
+	}
+
+	virtual ~sink_server()
+	{
+		close();
+	}
+
+	void set_policy(int p)
+	{
+		policy = p;
+	}
+
+	/**
+	 * Start listening.
+	 *
+	 * @name 'tcp://host:port', 'tcp://:port' or 'unix:/path/to/socket'
+	 */
+	int open(const char *name)
+	{
+		static const char prefix_tcp[] = "tcp://";
+		static const char prefix_unix[] = "unix:";
+		int ret;
+
+		if (strncmp(name, prefix_tcp, strlen(prefix_tcp)) == 0) {
+			ret = listen_tcp(name + strlen(prefix_tcp));
+		} else if (strncmp(name, prefix_unix, strlen(prefix_unix)) == 0) {
+			ret = listen_unix(name + strlen(prefix_unix));
+		} else {
+			fprintf(stderr, "Unknown server address '%s'\n", name);
+			ret = -EINVAL;
+		}
+		if (ret)
+			return ret;
+
+		fd_wake = eventfd(0, EFD_NONBLOCK);
+		if (fd_wake == -1) {
+			perror("eventfd");
+			return -errno;
+		}
+
+		ring.resize(SINK_SERVER_RING);
+		th = std::thread(&sink_server::run, this);
+
+		printf("server: listen '%s'\n", name);
+
+		return 0;
+	}
+
+	int write(const char *buf, size_t len)
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+
+		//Keep latest part if too large
+		if (len > ring.size()) {
+			buf += len - ring.size();
+			head += len - ring.size();
+			len = ring.size();
+		}
+
+		size_t pos = head % ring.size();
+		size_t n = std::min(len, ring.size() - pos);
+
+		memcpy(&ring[pos], buf, n);
+		memcpy(&ring[0], buf + n, len - n);
+		head += len;
+
+		if (need_wake.exchange(false)) {
+			uint64_t v = 1;
+
+			if (::write(fd_wake, &v, sizeof(v)) == -1 && errno != EAGAIN)
+				perror("write(eventfd)");
+		}
+
+		return 0;
+	}
+
+	void close()
+	{
+		if (th.joinable()) {
+			uint64_t v = 1;
+
+			stopping = true;
+			if (::write(fd_wake, &v, sizeof(v)) == -1)
+				perror("write(eventfd)");
+			th.join();
+		}
+
+		while (!clients.empty())
+			close_client(clients.size() - 1, -ESHUTDOWN);
+
+		if (fd_listen != -1)
+			::close(fd_listen);
+		fd_listen = -1;
+		if (fd_wake != -1)
+			::close(fd_wake);
+		fd_wake = -1;
+		if (!path_unix.empty() && is_bound_socket())
+			unlink(path_unix.c_str());
+		path_unix.clear();
+	}
+
+protected:
+	struct client {
+		int fd;
+		uint64_t cursor;
+		uint64_t cnt_skip;
+		//Chunk copied from the ring and not sent yet
+		std::vector<char> buf;
+		size_t pos_buf;
+	};
+
+	int listen_tcp(const char *addr)
+	{
+		std::string s = addr;
+		size_t colon = s.rfind(':');
+		struct addrinfo hints, *res;
+		int ret, on = 1;
+
+		if (colon == std::string::npos) {
+			fprintf(stderr, "No port number '%s'\n", addr);
+			return -EINVAL;
+		}
+
+		std::string host = s.substr(0, colon);
+		std::string serv = s.substr(colon + 1);
+
+		if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+			host = host.substr(1, host.size() - 2);
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		ret = getaddrinfo(host.empty() ? NULL : host.c_str(),
+			serv.c_str(), &hints, &res);
+		if (ret) {
+			fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+			fprintf(stderr, "Failed to resolve '%s'\n", addr);
+			return -EINVAL;
+		}
+
+		fd_listen = socket(res->ai_family, res->ai_socktype,
+			res->ai_protocol);
+		if (fd_listen == -1) {
+			perror("socket(STREAM)");
+			freeaddrinfo(res);
+			return -errno;
+		}
+		setsockopt(fd_listen, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		ret = bind(fd_listen, res->ai_addr, res->ai_addrlen);
+		freeaddrinfo(res);
+		if (ret == -1) {
+			perror("bind");
+			fprintf(stderr, "Failed to bind '%s'\n", addr);
+			return -errno;
+		}
+
+		return start_listen();
+	}
+
+	int listen_unix(const char *path)
+	{
+		struct sockaddr_un sa;
+		struct stat st;
+
+		if (strlen(path) >= sizeof(sa.sun_path)) {
+			fprintf(stderr, "Too long path '%s'\n", path);
+			return -EINVAL;
+		}
+
+		fd_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd_listen == -1) {
+			perror("socket(UNIX)");
+			return -errno;
+		}
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		strcpy(sa.sun_path, path);
+
+		//Remove the socket of previous run, never other files
+		if (lstat(path, &st) == 0) {
+			if (!S_ISSOCK(st.st_mode)) {
+				fprintf(stderr, "'%s' exists and is not a socket\n",
+					path);
+				return -EEXIST;
+			}
+			unlink(path);
+		}
+		if (bind(fd_listen, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+			perror("bind");
+			fprintf(stderr, "Failed to bind '%s'\n", path);
+			return -errno;
+		}
+		if (lstat(path, &st) == -1) {
+			perror("lstat");
+			return -errno;
+		}
+		path_unix = path;
+		dev_unix = st.st_dev;
+		ino_unix = st.st_ino;
+
+		return start_listen();
+	}
+
+	/**
+	 * Check the socket file is still the one bound by this server.
+	 */
+	bool is_bound_socket() const
+	{
+		struct stat st;
+
+		if (lstat(path_unix.c_str(), &st) == -1)
+			return false;
+
+		return S_ISSOCK(st.st_mode) && st.st_dev == dev_unix &&
+			st.st_ino == ino_unix;
+	}
+
+	int start_listen()
+	{
+		if (listen(fd_listen, 8) == -1) {
+			perror("listen");
+			return -errno;
+		}
+		fcntl(fd_listen, F_SETFL, fcntl(fd_listen, F_GETFL) | O_NONBLOCK);
+
+		return 0;
+	}
+
+	void accept_client()
+	{
+		client c;
+		int fd;
+
+		fd = accept(fd_listen, NULL, NULL);
+		if (fd == -1)
+			return;
+
+		if (clients.size() >= SINK_SERVER_CLIENTS) {
+			fprintf(stderr, "server: too many clients.\n");
+			::close(fd);
+			return;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		std::lock_guard<std::mutex> lk(mtx);
+
+		//Start from the latest packet
+		c.fd = fd;
+		c.cursor = head;
+		c.cnt_skip = 0;
+		c.pos_buf = 0;
+		clients.push_back(c);
+
+		printf("server: client %d connected.\n", fd);
+	}
+
+	/**
+	 * Copy the next chunk of the ring for the client.
+	 *
+	 * @return 0 if success, -ENOBUFS if the client is too slow and
+	 *         should be closed
+	 */
+	int fill_client(client& c)
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		uint64_t lag = head - c.cursor;
+		size_t pos = c.cursor % ring.size();
+		size_t n = std::min(lag, (uint64_t)(ring.size() - pos));
+
+		if (lag > ring.size() / 2) {
+			if (policy == SINK_SERVER_DROP)
+				return -ENOBUFS;
+
+			//Cursor is at the boundary of packets
+			c.cnt_skip += lag;
+			c.cursor = head;
+			return 0;
+		}
+
+		n = std::min(n, (size_t)SINK_SERVER_SEND);
+		c.buf.assign(&ring[pos], &ring[pos] + n);
+		c.pos_buf = 0;
+		c.cursor += n;
+
+		return 0;
+	}
+
+	/**
+	 * Send a chunk of ring to the client, never block.
+	 *
+	 * @return 0 if success, otherwise the client should be closed
+	 */
+	int send_client(client& c)
+	{
+		ssize_t ret;
+
+		if (c.pos_buf == c.buf.size()) {
+			ret = fill_client(c);
+			if (ret)
+				return ret;
+			if (c.pos_buf == c.buf.size())
+				return 0;
+		}
+
+		ret = send(c.fd, &c.buf[c.pos_buf], c.buf.size() - c.pos_buf,
+			MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR)
+				return 0;
+			return -errno;
+		}
+		c.pos_buf += ret;
+
+		return 0;
+	}
+
+	void close_client(size_t i, int reason)
+	{
+		client& c = clients[i];
+
+		printf("server: client %d closed (%s), skipped %" PRIu64 " bytes.\n",
+			c.fd, strerror(-reason), c.cnt_skip);
+		::close(c.fd);
+		clients.erase(clients.begin() + i);
+	}
+
+	bool has_data(const client& c)
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+
+		return c.pos_buf < c.buf.size() || c.cursor < head;
+	}
+
+	void run()
+	{
+		std::vector<struct pollfd> fds;
+
+		while (!stopping) {
+			bool pending = false;
+
+			fds.clear();
+			fds.push_back({fd_listen, POLLIN, 0});
+			fds.push_back({fd_wake, POLLIN, 0});
+			for (auto& c : clients) {
+				short ev = POLLIN;
+
+				if (has_data(c)) {
+					ev |= POLLOUT;
+					pending = true;
+				}
+				fds.push_back({c.fd, ev, 0});
+			}
+
+			if (!pending) {
+				need_wake = true;
+				//Recheck after the flag is visible to the writer
+				for (auto& c : clients) {
+					if (has_data(c))
+						pending = true;
+				}
+				if (pending)
+					continue;
+			}
+
+			if (poll(&fds[0], fds.size(), 100) == -1) {
+				if (errno == EINTR)
+					continue;
+				perror("poll");
+				break;
+			}
+
+			if (fds[1].revents & POLLIN) {
+				uint64_t v;
+
+				if (read(fd_wake, &v, sizeof(v)) == -1 && errno != EAGAIN)
+					perror("read(eventfd)");
+			}
+			if (fds[0].revents & POLLIN)
+				accept_client();
+
+			//Clients are appended by accept, check known ones only
+			for (size_t i = fds.size() - 2; i > 0; i--) {
+				struct pollfd& p = fds[i + 1];
+				int ret = 0;
+
+				if (p.revents & (POLLERR | POLLHUP)) {
+					ret = -EPIPE;
+				} else if (p.revents & POLLIN) {
+					char tmp[256];
+					ssize_t n = recv(p.fd, tmp, sizeof(tmp), 0);
+
+					//Ignore requests of clients
+					if (n == 0 || (n == -1 && errno != EAGAIN))
+						ret = -EPIPE;
+				}
+				if (!ret && (p.revents & POLLOUT))
+					ret = send_client(clients[i - 1]);
+				if (ret)
+					close_client(i - 1, ret);
+			}
+		}
+	}
+
+private:
+	int fd_listen;
+	int fd_wake;
+	int policy;
+	std::string path_unix;
+	//Socket file created by bind
+	dev_t dev_unix;
+	ino_t ino_unix;
+
+	std::mutex mtx;
+	std::vector<char> ring;
+	//Total bytes written
+	uint64_t head;
+
+	std::vector<client> clients;
+	std::atomic<bool> need_wake;
+	std::atomic<bool> stopping;
+	std::thread th;
+};
+
+#endif //SINK_SERVER_HPP__
@@ -0,0 +1,352 @@
+#ifndef SINK_SHM_HPP__
+#define SINK_SHM_HPP__
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <string>
+
+#include "sink.hpp"
+
+//Magic number of shared memory, 'ARIB'
+#define SINK_SHM_MAGIC           0x41524942
+#define SINK_SHM_VERSION         1
+//Size of ring, multiple of TS packet, so packets never wrap around
+#define SINK_SHM_SIZE            (188 * 7 * 8192)
+//Offset of ring from head of shared memory
+#define SINK_SHM_OFFSET          4096
+
+/**
+ * Header of shared memory, followed by the ring of TS packets.
+ *
+ * Positions are total bytes written from the start. The producer
+ * stores 'reserve' before overwriting the ring, and 'head' after
+ * packets are stored. Consumers read packets in place, and check
+ * 'reserve' afterwards to know the packets were not overwritten.
+ */
+struct sink_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size_ring;
+	uint64_t offset_ring;
+
+	std::atomic<uint64_t> reserve;
+	std::atomic<uint64_t> head;
+	//Futex word, incremented by each write
+	std::atomic<uint32_t> seq;
+	//Number of consumers sleeping on seq
+	std::atomic<uint32_t> waiters;
+	std::atomic<uint32_t> closed;
+};
+
+static inline long sink_shm_futex(std::atomic<uint32_t> *addr, int op,
+	uint32_t val, const struct timespec *ts)
+{
+	return syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), op,
+		val, ts, NULL, 0);
+}
+
+/**
+ * Shared memory ring for consumers on the same host.
+ *
+ * The producer never waits for consumers. Consumers which are too
+ * slow lose packets and catch up to the latest packet.
+ */
+class sink_shm : public sink_base {
+public:
+	sink_shm() :
+		fd(-1), hdr(NULL), ring(NULL), size_map(0)
+	{
+	}
+
+	virtual ~sink_shm()
+	{
+		close();
+	}
+
+	/**
+	 * Create shared memory.
+	 *
+	 * @name name of shared memory, such as '/arib_descramble'
+	 */
+	int open(const char *name)
+	{
+		size_map = SINK_SHM_OFFSET + SINK_SHM_SIZE;
+
+		fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1) {
+			perror("shm_open");
+			fprintf(stderr, "Failed to open '%s'\n", name);
+			return -errno;
+		}
+		name_shm = name;
+
+		if (ftruncate(fd, size_map) == -1) {
+			perror("ftruncate(shm)");
+			return -errno;
+		}
+
+		void *p = mmap(NULL, size_map, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) {
+			perror("mmap(shm)");
+			return -errno;
+		}
+
+		hdr = new(p) sink_shm_header;
+		hdr->version = SINK_SHM_VERSION;
+		hdr->size_ring = SINK_SHM_SIZE;
+		hdr->offset_ring = SINK_SHM_OFFSET;
+		hdr->reserve = 0;
+		hdr->head = 0;
+		hdr->seq = 0;
+		hdr->waiters = 0;
+		hdr->closed = 0;
+		ring = (char *)p + SINK_SHM_OFFSET;
+		std::atomic_thread_fence(std::memory_order_release);
+		hdr->magic = SINK_SHM_MAGIC;
+
+		printf("shm: '%s' %d bytes\n", name, SINK_SHM_SIZE);
+
+		return 0;
+	}
+
+	int write(const char *buf, size_t len)
+	{
+		uint64_t h = hdr->head.load(std::memory_order_relaxed);
+
+		//Keep latest part if too large
+		if (len > SINK_SHM_SIZE) {
+			buf += len - SINK_SHM_SIZE;
+			h += len - SINK_SHM_SIZE;
+			len = SINK_SHM_SIZE;
+		}
+
+		hdr->reserve.store(h + len, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		size_t pos = h % SINK_SHM_SIZE;
+		size_t n = std::min(len, (size_t)(SINK_SHM_SIZE - pos));
+
+		memcpy(&ring[pos], buf, n);
+		memcpy(&ring[0], buf + n, len - n);
+		hdr->head.store(h + len, std::memory_order_release);
+
+		wake();
+
+		return 0;
+	}
+
+	void close()
+	{
+		if (hdr) {
+			hdr->closed = 1;
+			wake();
+			munmap(hdr, size_map);
+		}
+		hdr = NULL;
+		ring = NULL;
+
+		if (fd != -1)
+			::close(fd);
+		fd = -1;
+		if (!name_shm.empty())
+			shm_unlink(name_shm.c_str());
+		name_shm.clear();
+	}
+
+protected:
+	void wake()
+	{
+		hdr->seq.fetch_add(1);
+		if (hdr->waiters.load() > 0)
+			sink_shm_futex(&hdr->seq, FUTEX_WAKE, INT_MAX, NULL);
+	}
+
+private:
+	int fd;
+	std::string name_shm;
+	sink_shm_header *hdr;
+	char *ring;
+	size_t size_map;
+};
+
+/**
+ * Consumer of shared memory ring.
+ *
+ * Usage:
+ *   peek() to get packets in place, use them, and then consume().
+ *   If consume() returns false, packets were overwritten while used.
+ */
+class sink_shm_reader {
+public:
+	sink_shm_reader() :
+		fd(-1), hdr(NULL), ring(NULL), size_map(0), cursor(0),
+		cnt_overrun(0)
+	{
+	}
+
+	virtual ~sink_shm_reader()
+	{
+		detach();
+	}
+
+	int attach(const char *name)
+	{
+		struct stat st;
+
+		fd = shm_open(name, O_RDWR, 0);
+		if (fd == -1) {
+			perror("shm_open");
+			fprintf(stderr, "Failed to open '%s'\n", name);
+			return -errno;
+		}
+
+		if (fstat(fd, &st) == -1) {
+			perror("fstat(shm)");
+			return -errno;
+		}
+		if ((size_t)st.st_size < SINK_SHM_OFFSET) {
+			fprintf(stderr, "Too small shared memory '%s'\n", name);
+			return -EINVAL;
+		}
+		size_map = st.st_size;
+
+		//Write access is needed to register as a waiter
+		void *p = mmap(NULL, size_map, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) {
+			perror("mmap(shm)");
+			return -errno;
+		}
+		hdr = (sink_shm_header *)p;
+
+		if (hdr->magic != SINK_SHM_MAGIC ||
+		    hdr->version != SINK_SHM_VERSION ||
+		    hdr->offset_ring + hdr->size_ring > size_map) {
+			fprintf(stderr, "Invalid shared memory '%s'\n", name);
+			return -EINVAL;
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		ring = (const char *)p + hdr->offset_ring;
+
+		//Start from the latest packet
+		cursor = hdr->head.load(std::memory_order_acquire);
+
+		return 0;
+	}
+
+	void detach()
+	{
+		if (hdr)
+			munmap(hdr, size_map);
+		hdr = NULL;
+		ring = NULL;
+		if (fd != -1)
+			::close(fd);
+		fd = -1;
+	}
+
+	/**
+	 * Wait for new packets.
+	 *
+	 * @ms timeout in msec
+	 * @return 0 if packets exist, -ETIMEDOUT, or -EPIPE if the
+	 *         producer is closed
+	 */
+	int wait(int ms)
+	{
+		struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+		uint32_t s = hdr->seq.load();
+
+		if (cursor != hdr->head.load(std::memory_order_acquire))
+			return 0;
+		if (hdr->closed)
+			return -EPIPE;
+
+		hdr->waiters.fetch_add(1);
+		//Recheck after registered, the producer may have written
+		if (cursor == hdr->head.load() && s == hdr->seq.load())
+			sink_shm_futex(&hdr->seq, FUTEX_WAIT, s, &ts);
+		hdr->waiters.fetch_sub(1);
+
+		if (cursor != hdr->head.load(std::memory_order_acquire))
+			return 0;
+
+		return hdr->closed ? -EPIPE : -ETIMEDOUT;
+	}
+
+	/**
+	 * Get packets in the ring without copy.
+	 *
+	 * @len size of packets
+	 * @return pointer to packets
+	 */
+	const char *peek(size_t& len)
+	{
+		uint64_t h = hdr->head.load(std::memory_order_acquire);
+		uint64_t size = hdr->size_ring;
+
+		//Overwritten, skip to the latest packet
+		if (h - cursor > size) {
+			cnt_overrun += h - cursor;
+			cursor = h;
+		}
+
+		size_t pos = cursor % size;
+
+		len = std::min(h - cursor, size - pos);
+
+		return &ring[pos];
+	}
+
+	/**
+	 * Release packets given by peek().
+	 *
+	 * @len size of packets to release
+	 * @return true if packets were valid while used
+	 */
+	bool consume(size_t len)
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t r = hdr->reserve.load(std::memory_order_relaxed);
+		bool valid = r <= cursor + hdr->size_ring;
+
+		if (!valid)
+			cnt_overrun += len;
+		cursor += len;
+
+		return valid;
+	}
+
+	uint64_t get_overrun() const
+	{
+		return cnt_overrun;
+	}
+
+private:
+	int fd;
+	sink_shm_header *hdr;
+	const char *ring;
+	size_t size_map;
+	uint64_t cursor;
+	uint64_t cnt_overrun;
+};
+
+#endif //SINK_SHM_HPP__
@@ -5,15 +5,18 @@
 #include <cstdint>
 #include <cinttypes>
 
+#include <map>
 #include <string>
 #include <vector>
 
 #include <winscard.h>
 
-class smart_card_reader {
+#include "card.hpp"
+
+class smart_card_reader : public card_reader_base {
 public:
 	smart_card_reader() :
-		valid(0)
+		state_pnp(SCARD_STATE_UNAWARE), valid(0)
 	{
 		establish();
 	}
@@ -38,6 +41,13 @@ public:
 		return valid;
 	}
 
+	card_base *create_card();
+
+	card_reader_base *create_reader() const
+	{
+		return new smart_card_reader();
+	}
+
 	int establish()
 	{
 		LONG ret;
@@ -116,13 +126,60 @@ public:
 		}
 	}
 
+	int wait_status_change(int ms)
+	{
+		std::vector<SCARD_READERSTATE> st(name_readers.size() + 1);
+		size_t n = name_readers.size();
+		LONG ret;
+
+		if (!valid)
+			return -EBADF;
+
+		memset(&st[0], 0, sizeof(st[0]) * st.size());
+		for (size_t i = 0; i < n; i++) {
+			st[i].szReader = name_readers[i].c_str();
+			st[i].dwCurrentState = state_readers[name_readers[i]];
+		}
+		//Notify plug and unplug of readers
+		st[n].szReader = "\\\\?PnP?\\Notification";
+		st[n].dwCurrentState = state_pnp;
+
+		ret = SCardGetStatusChange(scc, ms, &st[0], st.size());
+		if (ret == SCARD_E_TIMEOUT) {
+			return -ETIMEDOUT;
+		} else if (ret == SCARD_E_CANCELLED) {
+			return -EINTR;
+		} else if (ret != SCARD_S_SUCCESS) {
+			fprintf(stderr, "SCardGetStatusChange() failed.\n");
+			return -EIO;
+		}
+
+		for (size_t i = 0; i < n; i++)
+			state_readers[name_readers[i]] =
+				st[i].dwEventState & ~SCARD_STATE_CHANGED;
+		state_pnp = st[n].dwEventState & ~SCARD_STATE_CHANGED;
+
+		return 0;
+	}
+
+	void cancel()
+	{
+		if (!valid)
+			return;
+
+		SCardCancel(scc);
+	}
+
 private:
 	SCARDCONTEXT scc;
 	std::vector<std::string> name_readers;
+	//Last known state of readers for SCardGetStatusChange()
+	std::map<std::string, DWORD> state_readers;
+	DWORD state_pnp;
 	int valid;
 };
 
-class smart_card {
+class smart_card : public card_base {
 public:
 	smart_card() :
 		scrd(NULL), valid(0)
@@ -214,4 +271,9 @@ private:
 	int valid;
 };
 
+inline card_base *smart_card_reader::create_card()
+{
+	return new smart_card(*this);
+}
+
 #endif //SMART_CARD_HPP__
@@ -0,0 +1,321 @@
+#ifndef SOURCE_REPLAY_HPP__
+#define SOURCE_REPLAY_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "packet_ts.hpp"
+
+//Size of ring buffer, same as dvr device of DVB API
+#define SOURCE_REPLAY_RING       (188 * 1024 * 10)
+//Size of a read from file and a write to ring
+#define SOURCE_REPLAY_UNIT       (188 * 7 * 8)
+//Wrap around of PCR, 2^33 * 300
+#define SOURCE_REPLAY_PCR_WRAP   (0x200000000ULL * 300)
+//Max interval of PCRs in 27MHz, reset the clock if exceeded
+#define SOURCE_REPLAY_MAX_INTERVAL (27000000ULL / 2)
+
+/**
+ * Replay a TS file at broadcast rate, like a tuner.
+ *
+ * The file is read by background thread at fixed bitrate or at the
+ * rate of PCR, and stored to a bounded ring buffer. If the ring is
+ * full because the caller is too slow, packets are dropped and the
+ * overflow is counted like dvr device.
+ */
+class source_replay {
+public:
+	source_replay() :
+		fd(-1), bitrate(0), head(0), tail(0), eof(false),
+		stopping(false), cnt_overflow(0), cnt_drop(0), max_fill(0),
+		valid_pcr(false), pid_pcr(0x1fff), pcr_base(0), pcr_last(0),
+		off_last(0), rate_pcr(0), ns_base(0)
+	{
+	}
+
+	virtual ~source_replay()
+	{
+		close();
+	}
+
+	/**
+	 * Start replay.
+	 *
+	 * @name file name, '-' means stdin
+	 * @rate bits per second, or 0 to follow PCR
+	 */
+	int open(const char *name, uint64_t rate)
+	{
+		if (strcmp(name, "-") == 0)
+			fd = 0;
+		else
+			fd = ::open(name, O_RDONLY);
+		if (fd == -1) {
+			perror("open(in)");
+			fprintf(stderr, "Failed to open '%s'\n", name);
+			return -errno;
+		}
+
+		bitrate = rate;
+		ring.resize(SOURCE_REPLAY_RING);
+		th = std::thread(&source_replay::run, this);
+
+		return 0;
+	}
+
+	/**
+	 * Read packets from the ring.
+	 *
+	 * @return size of packets, or 0 if the replay is finished
+	 */
+	ssize_t read(char *buf, size_t len)
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+
+		cond.wait(lk, [this] { return eof || head != tail; });
+
+		size_t n = std::min((size_t)(head - tail), len);
+		size_t pos = tail % ring.size();
+
+		n -= n % 188;
+		n = std::min(n, ring.size() - pos);
+		memcpy(buf, &ring[pos], n);
+		tail += n;
+
+		return n;
+	}
+
+	void close()
+	{
+		if (th.joinable()) {
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				stopping = true;
+			}
+			th.join();
+
+			fprintf(stderr, "replay: %" PRIu64 " overflows, "
+				"%" PRIu64 " bytes dropped, max fill %d%%\n",
+				cnt_overflow, cnt_drop,
+				(int)(max_fill * 100 / ring.size()));
+		}
+
+		if (fd != -1 && fd != 0)
+			::close(fd);
+		fd = -1;
+	}
+
+	uint64_t get_overflow() const
+	{
+		return cnt_overflow;
+	}
+
+protected:
+	void run()
+	{
+		std::vector<char> unit(SOURCE_REPLAY_UNIT);
+		uint64_t off = 0;
+
+		ns_base = get_time();
+
+		while (1) {
+			ssize_t n = readn(&unit[0], unit.size());
+
+			if (n <= 0)
+				break;
+			n -= n % 188;
+
+			scan_pcr(&unit[0], n, off);
+			off += n;
+			sleep_until(get_deadline(off));
+
+			std::lock_guard<std::mutex> lk(mtx);
+
+			if (stopping)
+				break;
+			push(&unit[0], n);
+		}
+
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			eof = true;
+		}
+		cond.notify_one();
+	}
+
+	ssize_t readn(char *buf, size_t len)
+	{
+		size_t pos = 0;
+
+		while (pos < len) {
+			ssize_t n = ::read(fd, &buf[pos], len - pos);
+
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == -1) {
+				perror("read(in)");
+				return -1;
+			}
+			if (n == 0)
+				break;
+			pos += n;
+		}
+
+		return pos;
+	}
+
+	/**
+	 * Store packets to the ring, drop them if the ring is full.
+	 */
+	void push(const char *buf, size_t len)
+	{
+		if (head - tail + len > ring.size()) {
+			cnt_overflow++;
+			cnt_drop += len;
+			return;
+		}
+
+		size_t pos = head % ring.size();
+		size_t n = std::min(len, ring.size() - pos);
+
+		memcpy(&ring[pos], buf, n);
+		memcpy(&ring[0], buf + n, len - n);
+		head += len;
+		max_fill = std::max(max_fill, (size_t)(head - tail));
+
+		cond.notify_one();
+	}
+
+	/**
+	 * Find PCR and update the rate of the stream.
+	 */
+	void scan_pcr(char *buf, size_t len, uint64_t off)
+	{
+		if (bitrate)
+			return;
+
+		for (size_t pos = 0; pos + 188 <= len; pos += 188) {
+			bitstream<char *> bs(&buf[pos], 0, 188);
+			packet_ts ts;
+
+			if (!(buf[pos + 3] & 0x20) || (uint8_t)buf[pos + 4] == 0 ||
+			    !(buf[pos + 5] & 0x10))
+				continue;
+
+			ts.set_light_mode(true);
+			ts.peek(bs);
+			if (ts.is_error() || !ts.adapt.pcr_flag)
+				continue;
+			if (pid_pcr == 0x1fff)
+				pid_pcr = ts.pid;
+			if (ts.pid != pid_pcr)
+				continue;
+
+			update_pcr(ts.adapt.get_pcr(), off + pos);
+		}
+	}
+
+	void update_pcr(uint64_t pcr, uint64_t off)
+	{
+		uint64_t d = (pcr + SOURCE_REPLAY_PCR_WRAP - pcr_last) %
+			SOURCE_REPLAY_PCR_WRAP;
+
+		if (!valid_pcr || d == 0 || d > SOURCE_REPLAY_MAX_INTERVAL) {
+			//Restart the clock from the time of this PCR
+			ns_base = get_deadline(off);
+			pcr_base = pcr;
+			pcr_last = pcr;
+			off_last = off;
+			valid_pcr = true;
+			return;
+		}
+
+		//Bytes per 27MHz tick
+		rate_pcr = (double)(off - off_last) / d;
+		pcr_last = pcr;
+		off_last = off;
+	}
+
+	/**
+	 * Time to store the packets before given offset.
+	 */
+	uint64_t get_deadline(uint64_t off)
+	{
+		if (bitrate) {
+			//Split not to overflow by large offset
+			uint64_t bits = off * 8;
+
+			return ns_base + bits / bitrate * 1000000000 +
+				bits % bitrate * 1000000000 / bitrate;
+		}
+
+		if (!valid_pcr || rate_pcr <= 0)
+			return ns_base;
+
+		uint64_t d = (pcr_last + SOURCE_REPLAY_PCR_WRAP - pcr_base) %
+			SOURCE_REPLAY_PCR_WRAP;
+		double tick = d + (off - off_last) / rate_pcr;
+
+		return ns_base + (uint64_t)(tick * 1000 / 27);
+	}
+
+	static uint64_t get_time()
+	{
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+
+	static void sleep_until(uint64_t ns)
+	{
+		struct timespec ts;
+
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+		    &ts, NULL) == EINTR) {
+		}
+	}
+
+private:
+	int fd;
+	uint64_t bitrate;
+	std::thread th;
+
+	std::mutex mtx;
+	std::condition_variable cond;
+	std::vector<char> ring;
+	uint64_t head;
+	uint64_t tail;
+	bool eof;
+	bool stopping;
+	uint64_t cnt_overflow;
+	uint64_t cnt_drop;
+	size_t max_fill;
+
+	//Used by background thread only
+	bool valid_pcr;
+	uint32_t pid_pcr;
+	uint64_t pcr_base;
+	uint64_t pcr_last;
+	uint64_t off_last;
+	double rate_pcr;
+	uint64_t ns_base;
+};
+
+#endif //SOURCE_REPLAY_HPP__
@@ -0,0 +1,342 @@
+#ifndef SOURCE_UDP_HPP__
+#define SOURCE_UDP_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <algorithm>
+#include <string>
+
+//Size of TS payload of a datagram, 7 TS packets
+#define SOURCE_UDP_SLOT          (188 * 7)
+//Max number of datagrams received by a system call
+#define SOURCE_UDP_MSGS          64
+//Size of buffer for a read
+#define SOURCE_UDP_SIZE          (SOURCE_UDP_SLOT * SOURCE_UDP_MSGS)
+//Size of fixed RTP header
+#define SOURCE_UDP_RTP_HEADER    12
+//Room for CSRC list (15 * 4) and header extension (4 + 240 * 4) of RTP
+#define SOURCE_UDP_RTP_EXTRA     (15 * 4 + 4 + 240 * 4)
+//Requested size of socket receive buffer
+#define SOURCE_UDP_RCVBUF        (8 * 1024 * 1024)
+
+/**
+ * UDP or RTP input, unicast or multicast.
+ *
+ * Datagrams are received by recvmmsg() directly into the buffer of
+ * caller. The fixed RTP header is received into a separate buffer, so
+ * TS packets of datagrams are usually contiguous without copy. If RTP
+ * has CSRC list or header extension, the tail of the datagram is
+ * received into a spill buffer and copied after the head.
+ */
+class source_udp {
+public:
+	source_udp() :
+		sock(-1), rtp(false), valid_seq(false), seq_next(0),
+		cnt_loss(0), cnt_trunc(0)
+	{
+	}
+
+	virtual ~source_udp()
+	{
+		close();
+	}
+
+	/**
+	 * Check the name is address of network input.
+	 */
+	static bool is_source(const char *name)
+	{
+		return strncmp(name, "udp://", 6) == 0 ||
+			strncmp(name, "rtp://", 6) == 0;
+	}
+
+	/**
+	 * Bind and join the multicast group.
+	 *
+	 * @name 'udp://group:port', 'rtp://group:port' or 'udp://:port',
+	 *       '@' before the group is allowed
+	 */
+	int open(const char *name)
+	{
+		struct addrinfo hints, *res;
+		int ret, on = 1, sz = SOURCE_UDP_RCVBUF;
+
+		if (!is_source(name)) {
+			fprintf(stderr, "Unknown input '%s'\n", name);
+			return -EINVAL;
+		}
+		rtp = strncmp(name, "rtp://", 6) == 0;
+
+		std::string addr = name + 6;
+		size_t colon = addr.rfind(':');
+
+		if (colon == std::string::npos) {
+			fprintf(stderr, "No port number '%s'\n", name);
+			return -EINVAL;
+		}
+
+		std::string host = addr.substr(0, colon);
+		std::string serv = addr.substr(colon + 1);
+
+		if (!host.empty() && host.front() == '@')
+			host = host.substr(1);
+		if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+			host = host.substr(1, host.size() - 2);
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_flags = AI_PASSIVE;
+		ret = getaddrinfo(host.empty() ? NULL : host.c_str(),
+			serv.c_str(), &hints, &res);
+		if (ret) {
+			fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+			fprintf(stderr, "Failed to resolve '%s'\n", name);
+			return -EINVAL;
+		}
+
+		sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (sock == -1) {
+			perror("socket(DGRAM)");
+			freeaddrinfo(res);
+			return -errno;
+		}
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		//Not an error, limited by net.core.rmem_max
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+
+		//Bind to the group to receive the group only
+		ret = bind(sock, res->ai_addr, res->ai_addrlen);
+		if (ret == -1) {
+			perror("bind");
+			fprintf(stderr, "Failed to bind '%s'\n", name);
+			freeaddrinfo(res);
+			return -errno;
+		}
+
+		ret = join(res->ai_addr);
+		freeaddrinfo(res);
+		if (ret) {
+			fprintf(stderr, "Failed to join '%s'\n", name);
+			return ret;
+		}
+
+		return 0;
+	}
+
+	/**
+	 * Receive TS packets of one or more datagrams.
+	 *
+	 * @buf buffer for TS packets
+	 * @len size of buf, SOURCE_UDP_SLOT or larger
+	 * @return size of TS packets, or -1 if failed or interrupted
+	 */
+	ssize_t read(char *buf, size_t len)
+	{
+		struct mmsghdr msgs[SOURCE_UDP_MSGS];
+		struct iovec iovs[SOURCE_UDP_MSGS][3];
+		unsigned int cnt = len / SOURCE_UDP_SLOT;
+		size_t pos = 0;
+		int ret;
+
+		if (cnt > SOURCE_UDP_MSGS)
+			cnt = SOURCE_UDP_MSGS;
+
+		memset(msgs, 0, sizeof(msgs[0]) * cnt);
+		for (unsigned int i = 0; i < cnt; i++) {
+			struct iovec *iov = iovs[i];
+
+			if (rtp) {
+				iov->iov_base = hdrs[i];
+				iov->iov_len = SOURCE_UDP_RTP_HEADER;
+				iov++;
+			}
+			iov->iov_base = &buf[SOURCE_UDP_SLOT * i];
+			iov->iov_len = SOURCE_UDP_SLOT;
+			if (rtp) {
+				iov++;
+				iov->iov_base = spills[i];
+				iov->iov_len = SOURCE_UDP_RTP_EXTRA;
+			}
+			msgs[i].msg_hdr.msg_iov = iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = iov - iovs[i] + 1;
+		}
+
+		while (pos == 0) {
+			ret = recvmmsg(sock, msgs, cnt, MSG_WAITFORONE, NULL);
+			if (ret == -1) {
+				//Interrupted by signal, caller decides to stop or not
+				if (errno != EINTR)
+					perror("recvmmsg");
+				return -1;
+			}
+
+			for (int i = 0; i < ret; i++)
+				pos += gather(buf, pos, i, msgs[i]);
+		}
+
+		return pos;
+	}
+
+	void close()
+	{
+		if (sock == -1)
+			return;
+
+		if (cnt_loss || cnt_trunc)
+			fprintf(stderr, "udp: %" PRIu64 " datagrams lost, "
+				"%" PRIu64 " truncated\n", cnt_loss, cnt_trunc);
+		::close(sock);
+		sock = -1;
+	}
+
+	uint64_t get_lost() const
+	{
+		return cnt_loss;
+	}
+
+protected:
+	int join(const struct sockaddr *sa)
+	{
+		if (sa->sa_family == AF_INET) {
+			const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+			struct ip_mreqn mreq;
+
+			if (!IN_MULTICAST(ntohl(sin->sin_addr.s_addr)))
+				return 0;
+
+			memset(&mreq, 0, sizeof(mreq));
+			mreq.imr_multiaddr = sin->sin_addr;
+			mreq.imr_address.s_addr = htonl(INADDR_ANY);
+			mreq.imr_ifindex = 0;
+			if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+			    &mreq, sizeof(mreq)) == -1) {
+				perror("setsockopt(IP_ADD_MEMBERSHIP)");
+				return -errno;
+			}
+		} else if (sa->sa_family == AF_INET6) {
+			const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+			struct ipv6_mreq mreq;
+
+			if (!IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr))
+				return 0;
+
+			memset(&mreq, 0, sizeof(mreq));
+			mreq.ipv6mr_multiaddr = sin6->sin6_addr;
+			mreq.ipv6mr_interface = 0;
+			if (setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+			    &mreq, sizeof(mreq)) == -1) {
+				perror("setsockopt(IPV6_JOIN_GROUP)");
+				return -errno;
+			}
+		}
+
+		return 0;
+	}
+
+	/**
+	 * Move TS packets of i-th datagram to the end of packets.
+	 *
+	 * @return size of TS packets of the datagram
+	 */
+	size_t gather(char *buf, size_t pos, int i, const struct mmsghdr& msg)
+	{
+		char *slot = &buf[SOURCE_UDP_SLOT * i];
+		size_t len = msg.msg_len;
+		size_t off = 0, n, n_slot = 0;
+		bool trunc = msg.msg_hdr.msg_flags & MSG_TRUNC;
+
+		if (trunc)
+			cnt_trunc++;
+
+		if (rtp) {
+			const uint8_t *h = hdrs[i];
+
+			if (len < SOURCE_UDP_RTP_HEADER || (h[0] >> 6) != 2)
+				return 0;
+			len -= SOURCE_UDP_RTP_HEADER;
+
+			check_seq((h[2] << 8) | h[3]);
+
+			//CSRC list and header extension are in the slot
+			off = (h[0] & 0x0f) * 4;
+			if ((h[0] & 0x10) && off + 4 <= len) {
+				const uint8_t *x = (const uint8_t *)&slot[off];
+
+				off += 4 + ((x[2] << 8) | x[3]) * 4;
+			}
+			//Padding, the count at the end is lost if truncated
+			if ((h[0] & 0x20) && len > 0 && !trunc)
+				len -= std::min(len, (size_t)get_payload(slot, i, len - 1));
+			if (off > len)
+				return 0;
+		}
+
+		//Never exceed the slot, packets of next datagram follow it
+		n = std::min(len - off, (size_t)SOURCE_UDP_SLOT);
+		n -= n % 188;
+		if (off < SOURCE_UDP_SLOT)
+			n_slot = std::min(n, SOURCE_UDP_SLOT - off);
+		if (n_slot > 0 && &slot[off] != &buf[pos])
+			memmove(&buf[pos], &slot[off], n_slot);
+		if (n > n_slot)
+			memcpy(&buf[pos + n_slot],
+				&spills[i][off + n_slot - SOURCE_UDP_SLOT],
+				n - n_slot);
+
+		return n;
+	}
+
+	/**
+	 * Get a byte of RTP payload of i-th datagram, head of the payload
+	 * is in the slot and the rest is in the spill buffer.
+	 */
+	uint8_t get_payload(const char *slot, int i, size_t off) const
+	{
+		if (off < SOURCE_UDP_SLOT)
+			return slot[off];
+
+		return spills[i][off - SOURCE_UDP_SLOT];
+	}
+
+	void check_seq(uint32_t seq)
+	{
+		uint32_t d = (seq - seq_next) & 0xffff;
+
+		//Ignore reordered or duplicated datagrams
+		if (valid_seq && d != 0 && d < 0x8000) {
+			fprintf(stderr, "udp: %u datagrams lost, seq:%u\n",
+				d, seq);
+			cnt_loss += d;
+		}
+		if (!valid_seq || d < 0x8000) {
+			seq_next = (seq + 1) & 0xffff;
+			valid_seq = true;
+		}
+	}
+
+private:
+	int sock;
+	bool rtp;
+	uint8_t hdrs[SOURCE_UDP_MSGS][SOURCE_UDP_RTP_HEADER];
+	//Tail of datagrams which have CSRC list or header extension
+	uint8_t spills[SOURCE_UDP_MSGS][SOURCE_UDP_RTP_EXTRA];
+
+	bool valid_seq;
+	uint32_t seq_next;
+	uint64_t cnt_loss;
+	uint64_t cnt_trunc;
+};
+
+#endif //SOURCE_UDP_HPP__
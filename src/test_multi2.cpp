@@ -0,0 +1,325 @@
+#include <cstdarg>
+#include <cstdio>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+#include <getopt.h>
+
+#include <random>
+#include <vector>
+
+#include "packet_ts.hpp"
+#include "multi2.hpp"
+#include "multi2_sse2.hpp"
+#include "multi2_neon.hpp"
+#include "descrambler_ts.hpp"
+
+#define SIZE_TS          188
+
+struct test_kat {
+	//first 8bytes is data key, last 32bytes is system key
+	uint8_t key[ALL_KEY_SIZE];
+	uint8_t plain[DATA_BLK_SIZE];
+	uint8_t cipher[DATA_BLK_SIZE];
+	int round;
+};
+
+//Published known answers of MULTI2, also used by LibTomCrypt
+static const test_kat kats[] = {
+	{
+		{
+			0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		},
+		{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, },
+		{ 0xf8, 0x94, 0x40, 0x84, 0x5e, 0x11, 0xcf, 0x89, },
+		128,
+	},
+	{
+		{
+			0xb1, 0x27, 0xb9, 0x06, 0xe7, 0x56, 0x22, 0x38,
+
+			0x35, 0x91, 0x9d, 0x96, 0x07, 0x02, 0xe2, 0xce,
+			0x8d, 0x0b, 0x58, 0x3c, 0xc9, 0xc8, 0x9d, 0x59,
+			0xa2, 0xae, 0x96, 0x4e, 0x87, 0x82, 0x45, 0xed,
+			0x3f, 0x2e, 0x62, 0xd6, 0x36, 0x35, 0xd0, 0x67,
+		},
+		{ 0x1f, 0xb4, 0x60, 0x60, 0xd0, 0xb3, 0x4f, 0xa5, },
+		{ 0xca, 0x84, 0xa9, 0x34, 0x75, 0xc8, 0x60, 0xe5, },
+		216,
+	},
+};
+
+struct test_param {
+	size_t n_iter;
+	uint32_t seed;
+};
+
+static int cnt_fail;
+
+void usage(int argc, char *argv[])
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-s seed]\n\n"
+		"  -n iterations: Number of random keys (default: 2000)\n"
+		"  -s seed      : Seed of random keys and payloads\n",
+		argv[0]);
+}
+
+void fail(const char *backend, const char *test, const char *msg, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "FAIL: %s %s: ", backend, test);
+	va_start(ap, msg);
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+
+	cnt_fail++;
+}
+
+void fill_random(std::mt19937& rnd, uint8_t *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = rnd();
+}
+
+/**
+ * Run update, update4 and update8 of same N blocks.
+ */
+template <class M>
+void update_n(M& m, int n, uint8_t *buf_in, uint8_t *buf_out)
+{
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+		m.update8(&buf_in[i * DATA_BLK_SIZE], &buf_out[i * DATA_BLK_SIZE]);
+	for (; i + 4 <= n; i += 4)
+		m.update4(&buf_in[i * DATA_BLK_SIZE], &buf_out[i * DATA_BLK_SIZE]);
+	for (; i < n; i++)
+		m.update(buf_in, i * DATA_BLK_SIZE, buf_out, i * DATA_BLK_SIZE);
+}
+
+template <class M>
+void test_kat_backend(const char *name)
+{
+	for (size_t i = 0; i < sizeof(kats) / sizeof(kats[0]); i++) {
+		const test_kat& k = kats[i];
+		uint8_t key[ALL_KEY_SIZE];
+		uint8_t in[DATA_BLK_SIZE * 8], out[DATA_BLK_SIZE * 8];
+
+		memcpy(key, k.key, sizeof(key));
+
+		for (int n = 1; n <= 8; n++) {
+			M enc, dec;
+
+			enc.set_round(k.round);
+			enc.init(0, key, ALL_KEY_SIZE);
+			dec.set_round(k.round);
+			dec.init(1, key, ALL_KEY_SIZE);
+
+			for (int j = 0; j < n; j++)
+				memcpy(&in[j * DATA_BLK_SIZE], k.plain, DATA_BLK_SIZE);
+			update_n(enc, n, in, out);
+			for (int j = 0; j < n; j++) {
+				if (memcmp(&out[j * DATA_BLK_SIZE], k.cipher, DATA_BLK_SIZE))
+					fail(name, "kat", "encrypt vector %d, "
+						"%d blocks, block %d",
+						(int)i, n, j);
+			}
+
+			for (int j = 0; j < n; j++)
+				memcpy(&in[j * DATA_BLK_SIZE], k.cipher, DATA_BLK_SIZE);
+			update_n(dec, n, in, out);
+			for (int j = 0; j < n; j++) {
+				if (memcmp(&out[j * DATA_BLK_SIZE], k.plain, DATA_BLK_SIZE))
+					fail(name, "kat", "decrypt vector %d, "
+						"%d blocks, block %d",
+						(int)i, n, j);
+			}
+		}
+	}
+}
+
+/**
+ * Compare the backend with scalar multi2 by random keys and
+ * random number of blocks.
+ */
+template <class M>
+void test_fuzz_backend(const char *name, const test_param& p)
+{
+	std::mt19937 rnd(p.seed);
+	uint8_t key[ALL_KEY_SIZE];
+	uint8_t in[DATA_BLK_SIZE * 32];
+	uint8_t out[DATA_BLK_SIZE * 32], out_ref[DATA_BLK_SIZE * 32];
+
+	for (size_t i = 0; i < p.n_iter; i++) {
+		int dec = rnd() & 1;
+		int round = ((rnd() % 8) + 1) * 8;
+		int n = (rnd() % 32) + 1;
+		multi2 ref;
+		M m;
+
+		fill_random(rnd, key, sizeof(key));
+		fill_random(rnd, in, sizeof(in));
+
+		ref.set_round(round);
+		ref.init(dec, key, ALL_KEY_SIZE);
+		m.set_round(round);
+		m.init(dec, key, ALL_KEY_SIZE);
+
+		for (int j = 0; j < n; j++)
+			ref.update(in, j * DATA_BLK_SIZE, out_ref, j * DATA_BLK_SIZE);
+		update_n(m, n, in, out);
+
+		if (memcmp(out, out_ref, n * DATA_BLK_SIZE))
+			fail(name, "fuzz", "iteration %d, dec:%d, round:%d, "
+				"%d blocks", (int)i, dec, round, n);
+	}
+}
+
+/**
+ * Make a packet which has the payload of given length, the rest is
+ * filled by adaptation field.
+ */
+void build_packet(std::mt19937& rnd, uint8_t *pkt, size_t len_pay)
+{
+	size_t len_af = SIZE_TS - 4 - len_pay;
+
+	fill_random(rnd, pkt, SIZE_TS);
+
+	pkt[0] = 0x47;
+	pkt[1] = 0x01;
+	pkt[2] = 0x00;
+	if (len_af == 0) {
+		pkt[3] = 0x10;
+	} else {
+		pkt[3] = (len_pay == 0) ? 0x20 : 0x30;
+		pkt[4] = len_af - 1;
+		if (len_af > 1) {
+			pkt[5] = 0x00;
+			memset(&pkt[6], 0xff, len_af - 2);
+		}
+	}
+}
+
+/**
+ * Compare CBC + OFB of the backend with scalar multi2 for every
+ * payload length, including payloads shorter than a block.
+ */
+template <class M>
+void test_packet_backend(const char *name, const test_param& p)
+{
+	std::mt19937 rnd(p.seed);
+	uint8_t system_key[SYSTEM_KEY_SIZE];
+	basic_descrambler_ts<multi2> ref;
+	basic_descrambler_ts<M> desc;
+	uint8_t pkt[SIZE_TS], pkt_ref[SIZE_TS], pkt_orig[SIZE_TS];
+
+	for (size_t i = 0; i < p.n_iter; i++) {
+		uint64_t iv = ((uint64_t)rnd() << 32) | rnd();
+		uint64_t k_odd = ((uint64_t)rnd() << 32) | rnd();
+		uint64_t k_even = ((uint64_t)rnd() << 32) | rnd();
+		size_t len_pay = i % (SIZE_TS - 4 + 1);
+		uint32_t tsc = (rnd() & 1) ? 3 : 2;
+
+		fill_random(rnd, system_key, sizeof(system_key));
+		ref.set_system_key(system_key);
+		ref.set_init_vector(iv);
+		ref.set_data_key_odd(k_odd);
+		ref.set_data_key_even(k_even);
+		desc.set_system_key(system_key);
+		desc.set_init_vector(iv);
+		desc.set_data_key_odd(k_odd);
+		desc.set_data_key_even(k_even);
+
+		build_packet(rnd, pkt_orig, len_pay);
+		memcpy(pkt, pkt_orig, SIZE_TS);
+
+		//scramble by scalar, then descramble by both
+		bitstream<uint8_t *> bs(pkt, 0, SIZE_TS);
+		packet_ts ts;
+		ts.set_light_mode(true);
+		ts.peek(bs);
+		if (ts.is_error() || ts.payload_len != len_pay) {
+			fail(name, "packet", "bad test packet, len:%d",
+				(int)len_pay);
+			continue;
+		}
+		ref.scramble(ts, tsc);
+		ts.poke(bs);
+		memcpy(pkt_ref, pkt, SIZE_TS);
+
+		bitstream<uint8_t *> bs_ref(pkt_ref, 0, SIZE_TS);
+		packet_ts ts_ref;
+		ts_ref.set_light_mode(true);
+		ts_ref.peek(bs_ref);
+		ref.descramble(ts_ref);
+		ts_ref.poke(bs_ref);
+
+		packet_ts ts_desc;
+		ts_desc.set_light_mode(true);
+		ts_desc.peek(bs);
+		desc.descramble(ts_desc);
+		ts_desc.poke(bs);
+
+		if (memcmp(pkt_ref, pkt_orig, SIZE_TS))
+			fail("multi2", "packet", "round trip, "
+				"iteration %d, len:%d, tsc:%d",
+				(int)i, (int)len_pay, (int)tsc);
+		if (memcmp(pkt, pkt_ref, SIZE_TS))
+			fail(name, "packet", "iteration %d, len:%d, tsc:%d",
+				(int)i, (int)len_pay, (int)tsc);
+	}
+}
+
+template <class M>
+void test_backend(const char *name, const test_param& p)
+{
+	int cnt = cnt_fail;
+
+	test_kat_backend<M>(name);
+	test_fuzz_backend<M>(name, p);
+	test_packet_backend<M>(name, p);
+
+	printf("%-12s %s\n", name, (cnt == cnt_fail) ? "PASS" : "FAIL");
+}
+
+int main(int argc, char *argv[])
+{
+	test_param p;
+	int opt;
+
+	p.n_iter = 2000;
+	p.seed = 1;
+
+	while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			p.n_iter = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			p.seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argc, argv);
+			return -1;
+		}
+	}
+
+	test_backend<multi2>("multi2", p);
+#if defined(__SSE2__)
+	test_backend<multi2_sse2>("multi2_sse2", p);
+#endif
+#if defined(__ARM_NEON)
+	test_backend<multi2_neon>("multi2_neon", p);
+#endif
+
+	return cnt_fail ? 1 : 0;
+}
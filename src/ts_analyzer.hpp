@@ -0,0 +1,229 @@
+#ifndef TS_ANALYZER_HPP__
+#define TS_ANALYZER_HPP__
+
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+
+#include <map>
+#include <set>
+
+#include "ecm_index.hpp"
+#include "psi_pmt.hpp"
+#include "ts_stats.hpp"
+
+//Block size to read the file for analysis
+#define ANALYZE_BLOCK            (188 * 16384)
+
+//Wrap around of PCR in 27MHz
+#define ANALYZE_PCR_WRAP         (0x200000000ULL * 300)
+
+//Gap of PCR which is treated as discontinuity, 1 second in 27MHz
+#define ANALYZE_PCR_GAP          (27000000ULL)
+
+/**
+ * Analysis of a TS without descrambling.
+ *
+ * Only the TS header of packets is checked, and PSI and ECM sections
+ * are read by ecm_index. No card is accessed and nothing is written,
+ * so the scan runs at the speed of reading the file.
+ *
+ * Tables of PIDs are large, allocate on heap.
+ */
+class ts_analyzer {
+public:
+	ts_analyzer() :
+		off(0), pid_pcr(0x1fff), valid_pcr(false),
+		pcr_last(0), pcr_total(0), off_pcr_first(0), off_pcr_last(0)
+	{
+	}
+
+	/**
+	 * Scan packets, call in order of the file.
+	 *
+	 * @buf TS packets
+	 * @len size of buf, multiple of TS packet size
+	 */
+	void scan(const char *buf, size_t len)
+	{
+		len -= len % 188;
+
+		idx.scan(buf, len);
+		stats.add(buf, len);
+
+		for (size_t pos = 0; pos < len; pos += 188) {
+			const uint8_t *p = (const uint8_t *)&buf[pos];
+
+			//Adaptation field has PCR
+			if ((p[3] & 0x20) && p[4] >= 7 && (p[5] & 0x10) &&
+			    !(p[1] & 0x80))
+				update_pcr(p, off + pos);
+		}
+		off += len;
+	}
+
+	void report(FILE *fp) const
+	{
+		double sec = get_duration();
+		double rate = 0;
+
+		if (sec > 0)
+			rate = (double)(off_pcr_last - off_pcr_first) * 8 / sec;
+
+		fprintf(fp, "total: %" PRIu64 " bytes, %" PRIu64 " packets",
+			off, stats.get_total());
+		if (rate > 0) {
+			//Duration of the whole file at the rate of PCR
+			sec = (double)off * 8 / rate;
+			fprintf(fp, ", %.3f sec, %.3f Mbps", sec, rate / 1000000);
+		}
+		fprintf(fp, "\n");
+
+		report_services(fp);
+		report_pids(fp, sec);
+		report_ecms(fp, rate);
+	}
+
+protected:
+	void update_pcr(const uint8_t *p, uint64_t off_pkt)
+	{
+		uint32_t pid = ((p[1] & 0x1f) << 8) | p[2];
+
+		if (pid_pcr == 0x1fff)
+			pid_pcr = pid;
+		if (pid != pid_pcr)
+			return;
+
+		uint64_t base = ((uint64_t)p[6] << 25) | (p[7] << 17) |
+			(p[8] << 9) | (p[9] << 1) | (p[10] >> 7);
+		uint32_t ext = ((p[10] & 1) << 8) | p[11];
+		uint64_t pcr = base * 300 + ext;
+
+		if (!valid_pcr) {
+			off_pcr_first = off_pkt;
+		} else {
+			uint64_t d = (pcr + ANALYZE_PCR_WRAP - pcr_last) %
+				ANALYZE_PCR_WRAP;
+
+			//Skip the gap of discontinuity
+			if (d < ANALYZE_PCR_GAP)
+				pcr_total += d;
+		}
+		off_pcr_last = off_pkt;
+		pcr_last = pcr;
+		valid_pcr = true;
+	}
+
+	double get_duration() const
+	{
+		return (double)pcr_total / 27000000;
+	}
+
+	void report_services(FILE *fp) const
+	{
+		std::map<uint32_t, const ecm_index_entry *> pmts;
+
+		//Latest PMT of each PID
+		for (auto& e : idx.get_entries()) {
+			if (e.type == ECM_INDEX_PMT)
+				pmts[e.pid] = &e;
+		}
+
+		fprintf(fp, "services: %zu\n", pmts.size());
+		for (auto& kv : pmts) {
+			const ecm_index_entry& e = *kv.second;
+
+			fprintf(fp, "  program %5d(0x%04x): PMT 0x%04x ver %2d, "
+				"PCR 0x%04x\n",
+				e.program, e.program, e.pid, e.version,
+				e.pid_pcr);
+			for (auto& es : e.es) {
+				fprintf(fp, "    ES 0x%04x: %-18s(0x%02x)",
+					es.pid,
+					pmt_esinfo::get_stream_type_name(es.stream_type),
+					es.stream_type);
+				if (es.pid_ecm != 0x1fff)
+					fprintf(fp, ", ECM 0x%04x", es.pid_ecm);
+				fprintf(fp, "\n");
+			}
+		}
+	}
+
+	void report_pids(FILE *fp, double sec) const
+	{
+		uint64_t total = stats.get_total();
+		uint64_t scrambled = 0;
+
+		fprintf(fp, "pids:\n"
+			"   PID      packets      Mbps  scrambled  CC error  TEI\n");
+		for (uint32_t pid = 0; pid < 0x2000; pid++) {
+			const ts_pid_stats& s = stats.get(pid);
+
+			if (s.cnt == 0)
+				continue;
+
+			fprintf(fp, "0x%04x %12" PRIu64, pid, s.cnt);
+			if (sec > 0)
+				fprintf(fp, " %9.3f",
+					(double)s.cnt * 188 * 8 / sec / 1000000);
+			else
+				fprintf(fp, " %9s", "-");
+			fprintf(fp, " %9.2f%% %9" PRIu64 " %4" PRIu64 "\n",
+				(double)s.cnt_scrambled * 100 / s.cnt,
+				s.cnt_cc_error, s.cnt_tei);
+			scrambled += s.cnt_scrambled;
+		}
+		if (total)
+			fprintf(fp, "scrambled: %" PRIu64 " of %" PRIu64
+				" packets (%.2f%%)\n",
+				scrambled, total, (double)scrambled * 100 / total);
+	}
+
+	void report_ecms(FILE *fp, double rate) const
+	{
+		std::map<uint32_t, std::vector<uint64_t>> changes;
+		std::set<size_t> bodies;
+
+		for (auto& e : idx.get_entries()) {
+			if (e.type != ECM_INDEX_ECM)
+				continue;
+
+			changes[e.pid].push_back(e.offset);
+			bodies.insert(e.body);
+		}
+
+		fprintf(fp, "ecms: %zu PIDs, %zu distinct bodies\n",
+			changes.size(), bodies.size());
+		for (auto& kv : changes) {
+			const ts_pid_stats& s = stats.get(kv.first);
+			const std::vector<uint64_t>& offs = kv.second;
+
+			fprintf(fp, "  ECM 0x%04x: %" PRIu64 " sections, "
+				"%zu versions", kv.first, s.cnt_pusi, offs.size());
+			if (rate > 0 && s.cnt_pusi > 0)
+				fprintf(fp, ", every %.3f sec",
+					(double)off * 8 / rate / s.cnt_pusi);
+			if (rate > 0 && offs.size() > 1)
+				fprintf(fp, ", key changes every %.3f sec",
+					(double)(offs.back() - offs.front()) * 8 /
+					rate / (offs.size() - 1));
+			fprintf(fp, "\n");
+		}
+	}
+
+private:
+	ecm_index idx;
+	ts_stats stats;
+	uint64_t off;
+
+	//First PCR PID found
+	uint32_t pid_pcr;
+	bool valid_pcr;
+	uint64_t pcr_last;
+	//Sum of PCR intervals in 27MHz
+	uint64_t pcr_total;
+	uint64_t off_pcr_first;
+	uint64_t off_pcr_last;
+};
+
+#endif //TS_ANALYZER_HPP__
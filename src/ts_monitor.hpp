@@ -0,0 +1,86 @@
+#ifndef TS_MONITOR_HPP__
+#define TS_MONITOR_HPP__
+
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "ts_stats.hpp"
+
+/**
+ * Health monitor of the output.
+ *
+ * Counts continuity errors, packets with transport_error_indicator and
+ * packets which are still scrambled after descrambling, for each PID.
+ * Errors of CC and TEI come from the tuner or the dvr buffer, and
+ * scrambled packets come from the delay or loss of keys.
+ *
+ * Tables of PIDs are large, allocate on heap.
+ */
+class ts_monitor {
+public:
+	ts_monitor()
+	{
+		memset(last, 0, sizeof(last));
+	}
+
+	/**
+	 * Check packets which are written to the output.
+	 *
+	 * @buf TS packets
+	 * @len size of buf, multiple of TS packet size
+	 */
+	void write(const char *buf, size_t len)
+	{
+		stats.add(buf, len);
+	}
+
+	/**
+	 * Report PIDs which have errors.
+	 *
+	 * @fp    destination
+	 * @total report counts from the start, otherwise report
+	 *        increases from the last report
+	 */
+	void report(FILE *fp, bool total)
+	{
+		uint64_t sum_cc = 0, sum_tei = 0, sum_scr = 0;
+
+		for (uint32_t pid = 0; pid < 0x2000; pid++) {
+			const ts_pid_stats& s = stats.get(pid);
+			ts_pid_stats& l = last[pid];
+			uint64_t cc = s.cnt_cc_error;
+			uint64_t tei = s.cnt_tei;
+			uint64_t scr = s.cnt_scrambled;
+
+			if (!total) {
+				cc -= l.cnt_cc_error;
+				tei -= l.cnt_tei;
+				scr -= l.cnt_scrambled;
+			}
+			l = s;
+
+			if (cc == 0 && tei == 0 && scr == 0)
+				continue;
+
+			fprintf(fp, "monitor: PID 0x%04x: CC error %" PRIu64
+				", TEI %" PRIu64 ", scrambled %" PRIu64 "\n",
+				pid, cc, tei, scr);
+			sum_cc += cc;
+			sum_tei += tei;
+			sum_scr += scr;
+		}
+
+		fprintf(fp, "monitor: %s: CC error %" PRIu64 ", TEI %" PRIu64
+			", scrambled %" PRIu64 "\n",
+			total ? "total" : "interval", sum_cc, sum_tei, sum_scr);
+	}
+
+private:
+	ts_stats stats;
+	//Counters at the last report
+	ts_pid_stats last[0x2000];
+};
+
+#endif //TS_MONITOR_HPP__
@@ -0,0 +1,114 @@
+#ifndef TS_STATS_HPP__
+#define TS_STATS_HPP__
+
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Counters of a PID.
+ */
+struct ts_pid_stats {
+	uint64_t cnt;
+	uint64_t cnt_pusi;
+	uint64_t cnt_scrambled;
+	uint64_t cnt_cc_error;
+	uint64_t cnt_tei;
+	//Last continuity_counter, or -1
+	int last_cc;
+	//Last packet was a duplicate
+	bool dup;
+};
+
+/**
+ * Per-PID counters of packets, checked by the TS header only.
+ *
+ * Continuity counter is checked for packets with payload. A duplicate
+ * packet (same counter) is allowed once, and discontinuity_indicator
+ * or a packet with transport_error_indicator resets the counter.
+ */
+class ts_stats {
+public:
+	ts_stats()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		memset(pids, 0, sizeof(pids));
+		for (int i = 0; i < 0x2000; i++)
+			pids[i].last_cc = -1;
+		cnt = 0;
+	}
+
+	/**
+	 * Count TS packets.
+	 *
+	 * @buf TS packets
+	 * @len size of buf, multiple of TS packet size
+	 */
+	void add(const char *buf, size_t len)
+	{
+		for (size_t pos = 0; pos + 188 <= len; pos += 188)
+			add_packet((const uint8_t *)&buf[pos]);
+	}
+
+	void add_packet(const uint8_t *p)
+	{
+		uint32_t pid = ((p[1] & 0x1f) << 8) | p[2];
+		ts_pid_stats& s = pids[pid];
+		uint32_t afc = (p[3] >> 4) & 3;
+		int cc = p[3] & 0x0f;
+
+		if (p[0] != 0x47)
+			return;
+
+		cnt++;
+		s.cnt++;
+		if (p[1] & 0x80) {
+			//Header is not reliable, restart checking of CC
+			s.cnt_tei++;
+			s.last_cc = -1;
+			return;
+		}
+		if (p[1] & 0x40)
+			s.cnt_pusi++;
+		if (p[3] & 0x80)
+			s.cnt_scrambled++;
+
+		if (pid == 0x1fff || !(afc & 1))
+			return;
+
+		//discontinuity_indicator
+		if ((afc & 2) && p[4] > 0 && (p[5] & 0x80)) {
+			s.last_cc = cc;
+			s.dup = false;
+			return;
+		}
+
+		if (s.last_cc == cc && !s.dup) {
+			s.dup = true;
+			return;
+		}
+		if (s.last_cc != -1 && ((s.last_cc + 1) & 0x0f) != cc)
+			s.cnt_cc_error++;
+		s.last_cc = cc;
+		s.dup = false;
+	}
+
+	const ts_pid_stats& get(uint32_t pid) const
+	{
+		return pids[pid];
+	}
+
+	uint64_t get_total() const
+	{
+		return cnt;
+	}
+
+private:
+	ts_pid_stats pids[0x2000];
+	uint64_t cnt;
+};
+
+#endif //TS_STATS_HPP__